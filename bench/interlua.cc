@@ -1,5 +1,6 @@
-#include "interlua.hh"
+#include "interlua_ext.hh"
 #include <cstdio>
+#include <cstring>
 
 //============================================================================
 // Set and get
@@ -36,6 +37,41 @@ print("Getter/setter (average time): " .. average/N)
 
 )*****";
 
+//============================================================================
+// Set and get, compile-time bound
+//============================================================================
+
+class DirectSetGet {
+	double n = 0.0;
+public:
+	void set(double n) { this->n = n; }
+	double get() const { return this->n; }
+};
+
+const char direct_set_and_get[] = R"*****(
+
+local N = 10
+local average = 0
+local times = 1000000
+for i = 0, N do
+	local obj = DirectSetGet()
+	local t0 = os.clock()
+	for i = 1, times do
+		obj:set(i)
+		if obj:get() ~= i then
+			error("failed")
+		end
+	end
+	local dt = os.clock() - t0
+	if i ~= 0 then
+		average = average + dt
+	end
+end
+
+print("Getter/setter, compile-time bound (average time): " .. average/N)
+
+)*****";
+
 //============================================================================
 // Variable set and get
 //============================================================================
@@ -70,6 +106,39 @@ print("Variable get/set (average time): " .. average/N)
 
 )*****";
 
+//============================================================================
+// Field set and get
+//============================================================================
+
+class FieldSetGet {
+public:
+	double n = 0.0;
+};
+
+const char field_set_and_get[] = R"*****(
+
+local N = 10
+local average = 0
+local times = 1000000
+for i = 0, N do
+	local obj = FieldSetGet()
+	local t0 = os.clock()
+	for i = 1, times do
+		obj.n = i
+		if obj.n ~= i then
+			error("failed")
+		end
+	end
+	local dt = os.clock() - t0
+	if i ~= 0 then
+		average = average + dt
+	end
+end
+
+print("Field get/set (average time): " .. average/N)
+
+)*****";
+
 //============================================================================
 // Derived as Base
 //============================================================================
@@ -114,6 +183,603 @@ print("Derived as base (average time): " .. average/N)
 )*****";
 
 
+//============================================================================
+// Mixed arguments
+//============================================================================
+
+class Mixed {
+	double n = 0.0;
+public:
+	void add(const Mixed &other, double scale, const char *tag) {
+		n += other.n * scale + (tag ? 1 : 0);
+	}
+	void add_ref(InterLua::Ref other, double scale) {
+		n += other.As<const Mixed&>().n * scale;
+	}
+	double get() const { return n; }
+};
+
+const char mixed_arguments[] = R"*****(
+
+local function bench(name, f)
+	local N = 10
+	local average = 0
+	local times = 1000000
+	for i = 0, N do
+		local obj = Mixed()
+		local other = Mixed()
+		local t0 = os.clock()
+		f(obj, other, times)
+		local dt = os.clock() - t0
+		if i ~= 0 then
+			average = average + dt
+		end
+		assert(obj:get() >= 0)
+	end
+
+	print(name .. " (average time): " .. average/N)
+end
+
+bench("Mixed arguments, class reference", function(obj, other, times)
+	for i = 1, times do
+		obj:add(other, 0.5, "tag")
+	end
+end)
+
+bench("Mixed arguments, Ref", function(obj, other, times)
+	for i = 1, times do
+		obj:add_ref(other, 0.5)
+	end
+end)
+
+)*****";
+
+//============================================================================
+// Deep hierarchy
+//============================================================================
+
+class Level0 {
+	int n = 0;
+public:
+	virtual ~Level0() {}
+	void increment_a_root(Level0 *root) {
+		root->n++;
+	}
+
+	int get_n() const { return n; }
+};
+
+class Level1 : public Level0 {};
+class Level2 : public Level1 {};
+class Level3 : public Level2 {};
+class Level4 : public Level3 {};
+class Level5 : public Level4 {};
+class Level6 : public Level5 {};
+
+const char deep_hierarchy[] = R"*****(
+
+local function bench(class, depth)
+	local N = 10
+	local average = 0
+	local times = 1000000
+	for i = 0, N do
+		local obj = class()
+		local increment_me = class()
+		local t0 = os.clock()
+		for i = 1, times do
+			obj:increment_a_root(increment_me)
+		end
+		local dt = os.clock() - t0
+		if i ~= 0 then
+			average = average + dt
+		end
+
+		assert(obj:get_n() == 0 and increment_me:get_n() == times)
+	end
+
+	print("Derived as root, depth " .. depth .. " (average time): " .. average/N)
+end
+
+bench(Level1, 1)
+bench(Level3, 3)
+bench(Level6, 6)
+
+)*****";
+
+//============================================================================
+// Checked vs trusted
+//============================================================================
+
+class TrustedSetGet : public SetGet {};
+class TrustedDerived : public Derived {};
+
+const char checked_vs_trusted[] = R"*****(
+
+local function bench(name, f)
+	local N = 10
+	local average = 0
+	local times = 1000000
+	for i = 0, N do
+		local t0 = os.clock()
+		f(times)
+		local dt = os.clock() - t0
+		if i ~= 0 then
+			average = average + dt
+		end
+	end
+
+	print(name .. " (average time): " .. average/N)
+end
+
+local function set_and_get(class)
+	return function(times)
+		local obj = class()
+		for i = 1, times do
+			obj:set(i)
+			if obj:get() ~= i then
+				error("failed")
+			end
+		end
+	end
+end
+
+local function derived_as_base(class)
+	return function(times)
+		local obj = class()
+		local increment_me = class()
+		for i = 1, times do
+			obj:increment_a_base(increment_me)
+		end
+	end
+end
+
+bench("Getter/setter, checked", set_and_get(SetGet))
+bench("Getter/setter, trusted", set_and_get(TrustedSetGet))
+bench("Derived as base, checked", derived_as_base(Derived))
+bench("Derived as base, trusted", derived_as_base(TrustedDerived))
+
+)*****";
+
+//============================================================================
+// Returning values
+//============================================================================
+
+struct Vec3 {
+	double x = 0.0, y = 0.0, z = 0.0;
+
+	Vec3() {}
+	Vec3(double x, double y, double z): x(x), y(y), z(z) {}
+	Vec3 add(const Vec3 &other) const {
+		return {x + other.x, y + other.y, z + other.z};
+	}
+	double get_x() const { return x; }
+};
+
+struct Block {
+	unsigned char bytes[1024];
+
+	Block() {}
+	Block(unsigned char v) { memset(bytes, v, sizeof(bytes)); }
+	Block next() const { return Block(bytes[0] + 1); }
+};
+
+const char returning_values[] = R"*****(
+
+local function bench(name, f)
+	local N = 10
+	local average = 0
+	local times = 1000000
+	for i = 0, N do
+		local t0 = os.clock()
+		f(times)
+		local dt = os.clock() - t0
+		if i ~= 0 then
+			average = average + dt
+		end
+	end
+
+	print(name .. " (average time): " .. average/N)
+end
+
+bench("Returning values, constructor", function(times)
+	for i = 1, times do
+		local v = Vec3(i, i, i)
+	end
+end)
+
+bench("Returning values, method", function(times)
+	local a, b = Vec3(1, 2, 3), Vec3(3, 2, 1)
+	for i = 1, times do
+		local v = a:add(b)
+	end
+	assert(a:add(b):get_x() == 4)
+end)
+
+bench("Returning values, operator", function(times)
+	local a, b = Vec3(1, 2, 3), Vec3(3, 2, 1)
+	for i = 1, times do
+		local v = a + b
+	end
+	assert((a + b):get_x() == 4)
+end)
+
+bench("Returning values, 1 KB struct", function(times)
+	local block = Block()
+	for i = 1, times do
+		local v = block:next()
+	end
+end)
+
+)*****";
+
+//============================================================================
+// Returning pointers
+//============================================================================
+
+template <int N>
+class TreeN {
+	TreeN *child = nullptr;
+public:
+	TreeN *get_child() { return child ? child : this; }
+};
+
+using Tree = TreeN<0>;
+using CachedTree = TreeN<1>;
+
+const char returning_pointers[] = R"*****(
+
+local function bench(name, obj)
+	local N = 10
+	local average = 0
+	local times = 1000000
+	for i = 0, N do
+		local t0 = os.clock()
+		for i = 1, times do
+			local child = obj:get_child()
+		end
+		local dt = os.clock() - t0
+		if i ~= 0 then
+			average = average + dt
+		end
+	end
+
+	print(name .. " (average time): " .. average/N)
+end
+
+bench("Returning pointers", Tree())
+bench("Returning pointers, cached", CachedTree())
+
+)*****";
+
+//============================================================================
+// String arguments
+//============================================================================
+
+static size_t payload_cstr(const char *s) { return strlen(s); }
+static size_t payload_view(InterLua::StringView s) { return s.len; }
+static size_t payload_string(const std::string &s) { return s.size(); }
+
+const char string_arguments[] = R"*****(
+
+local function bench(name, f)
+	local N = 10
+	local average = 0
+	local times = 1000000
+	local payload = string.rep("x", 4096)
+	for i = 0, N do
+		local t0 = os.clock()
+		for i = 1, times do
+			f(payload)
+		end
+		local dt = os.clock() - t0
+		if i ~= 0 then
+			average = average + dt
+		end
+	end
+	assert(f(payload) == 4096)
+
+	print(name .. " (average time): " .. average/N)
+end
+
+bench("String arguments, const char*", payload_cstr)
+bench("String arguments, StringView", payload_view)
+bench("String arguments, std::string", payload_string)
+
+)*****";
+
+//============================================================================
+// Containers
+//============================================================================
+
+static double container_sum(const std::vector<double> &v) {
+	double sum = 0;
+	for (double n : v)
+		sum += n;
+	return sum;
+}
+
+static std::vector<double> container_iota(int n) {
+	std::vector<double> out(n);
+	for (int i = 0; i < n; i++)
+		out[i] = i;
+	return out;
+}
+
+static size_t container_keys(const std::unordered_map<std::string, double> &m) {
+	return m.size();
+}
+
+static std::vector<double> proxied;
+
+static InterLua::ContainerRef<std::vector<double>> container_proxy(int n) {
+	proxied = container_iota(n);
+	return proxied;
+}
+
+const char containers[] = R"*****(
+
+local function bench(name, n, f, arg)
+	local N = 10
+	local average = 0
+	-- a million elements per run
+	local times = 1000000 / n
+	for i = 0, N do
+		local t0 = os.clock()
+		for i = 1, times do
+			f(arg)
+		end
+		local dt = os.clock() - t0
+		if i ~= 0 then
+			average = average + dt
+		end
+	end
+
+	print(name .. " [" .. n .. "] (average time): " .. average/N)
+end
+
+for _, n in ipairs({10, 1000, 100000}) do
+	local array, map = {}, {}
+	for i = 1, n do
+		array[i] = i
+		map["k" .. i] = i
+	end
+	bench("Lua to std::vector", n, container_sum, array)
+	bench("std::vector to Lua", n, container_iota, n)
+	bench("Lua to std::unordered_map", n, container_keys, map)
+	bench("std::vector proxy, reading all", n, function(v)
+		local sum = 0
+		for i = 1, #v do
+			sum = sum + v[i]
+		end
+	end, container_proxy(n))
+end
+
+)*****";
+
+//============================================================================
+// Buffers
+//============================================================================
+
+const char buffers[] = R"*****(
+
+local function bench(name, f, arg)
+	local N = 10
+	local average = 0
+	local times = 100
+	for i = 0, N do
+		local t0 = os.clock()
+		for i = 1, times do
+			f(arg)
+		end
+		local dt = os.clock() - t0
+		if i ~= 0 then
+			average = average + dt
+		end
+	end
+
+	print(name .. " (average time): " .. average/N)
+end
+
+local n = 100000
+local t = {}
+for i = 1, n do
+	t[i] = i
+end
+
+bench("Scale and sum 100k floats, table", function(t)
+	for i = 1, #t do
+		t[i] = t[i] * 0.5 + 1
+	end
+	local sum = 0
+	for i = 1, #t do
+		sum = sum + t[i]
+	end
+end, t)
+bench("Scale and sum 100k floats, FloatBuffer", function(b)
+	b:scale(0.5, 1):sum()
+end, FloatBuffer(t))
+
+)*****";
+
+//============================================================================
+// Table access
+//============================================================================
+
+static double table_ref(InterLua::Ref t) {
+	return t["pool"]["size"].As<double>() + t["timeout"].As<double>();
+}
+
+static double table_stackref(InterLua::StackRef t) {
+	return t["pool"]["size"].As<double>() + t["timeout"].As<double>();
+}
+
+static double table_get(InterLua::Ref t) {
+	return t.Get("pool", "size").As<double>() + t.Get("timeout").As<double>();
+}
+
+static InterLua::Path pool_size;
+
+static double table_path(InterLua::StackRef t) {
+	return t.Get(pool_size).As<double>() + t["timeout"].As<double>();
+}
+
+const char table_access[] = R"*****(
+
+local function bench(name, f)
+	local N = 10
+	local average = 0
+	local times = 1000000
+	local config = {pool = {size = 8}, timeout = 30}
+	for i = 0, N do
+		local t0 = os.clock()
+		for i = 1, times do
+			f(config)
+		end
+		local dt = os.clock() - t0
+		if i ~= 0 then
+			average = average + dt
+		end
+	end
+
+	print(name .. " (average time): " .. average/N)
+end
+
+bench("Table access, Ref", table_ref)
+bench("Table access, StackRef", table_stackref)
+bench("Table access, Ref::Get", table_get)
+bench("Table access, StackRef and Path", table_path)
+
+)*****";
+
+//============================================================================
+// Calling lua
+//============================================================================
+
+static double call_ref(InterLua::Ref f, int times) {
+	double sum = 0;
+	for (int i = 0; i < times; i++)
+		sum += f(i, 0.5).As<double>();
+	return sum;
+}
+
+static double call_typed(InterLua::LuaFunction<double (int, double)> f, int times) {
+	double sum = 0;
+	for (int i = 0; i < times; i++)
+		sum += f(i, 0.5);
+	return sum;
+}
+
+static double call_table(InterLua::Ref f, int times) {
+	double sum = 0;
+	for (int i = 0; i < times; i++) {
+		auto t = f(i);
+		sum += t[1].As<double>() + t[2].As<double>();
+	}
+	return sum;
+}
+
+static double call_tuple(InterLua::LuaFunction<std::tuple<double, double> (int)> f, int times) {
+	double sum = 0;
+	for (int i = 0; i < times; i++) {
+		auto t = f(i);
+		sum += std::get<0>(t) + std::get<1>(t);
+	}
+	return sum;
+}
+
+const char calling_lua[] = R"*****(
+
+local function bench(name, f, callback)
+	local N = 10
+	local average = 0
+	local times = 1000000
+	for i = 0, N do
+		local t0 = os.clock()
+		f(callback, times)
+		local dt = os.clock() - t0
+		if i ~= 0 then
+			average = average + dt
+		end
+	end
+
+	print(name .. " (average time): " .. average/N)
+end
+
+local function mul(i, x) return i * x end
+bench("Calling lua, Ref::operator()", call_ref, mul)
+bench("Calling lua, LuaFunction", call_typed, mul)
+bench("Two results, table and Ref", call_table, function(i) return {i, i * 2} end)
+bench("Two results, std::tuple", call_tuple, function(i) return i, i * 2 end)
+
+)*****";
+
+//============================================================================
+// Startup
+//============================================================================
+
+// a new state with a few dozen bindings, the way short-lived states start
+static void startup() {
+	lua_State *L = luaL_newstate();
+	InterLua::GlobalNamespace(L).
+		Class<SetGet>("SetGet").
+			Constructor().
+			Function("set", &SetGet::set).
+			Function("get", &SetGet::get).
+		End().
+		Class<Vec3>("Vec3").
+			Constructor<double, double, double>().
+			Function("add", &Vec3::add).
+			Operator("__add", &Vec3::add).
+			Function("get_x", &Vec3::get_x).
+		End().
+		Class<Mixed>("Mixed").
+			Constructor().
+			Function("add", &Mixed::add).
+			Function("add_ref", &Mixed::add_ref).
+			Function("get", &Mixed::get).
+		End().
+		Class<FieldSetGet>("FieldSetGet").
+			Fields().
+			Constructor().
+			Variable("n", &FieldSetGet::n).
+		End().
+		Class<Level0>("Level0").
+			Constructor().
+			Function("increment_a_root", &Level0::increment_a_root).
+			Function("get_n", &Level0::get_n).
+		End().
+		DerivedClass<Level1, Level0>("Level1").Constructor().End().
+		DerivedClass<Level2, Level1>("Level2").Constructor().End().
+		DerivedClass<Level3, Level2>("Level3").Constructor().End().
+		Namespace("reopened").
+			Class<SetGet>("SetGet").
+				Function("set2", &SetGet::set).
+			End().
+		End().
+	End();
+	lua_close(L);
+}
+
+const char startup_time[] = R"*****(
+
+local N = 10
+local average = 0
+local times = 10000
+for i = 0, N do
+	local t0 = os.clock()
+	for i = 1, times do
+		startup()
+	end
+	local dt = os.clock() - t0
+	if i ~= 0 then
+		average = average + dt
+	end
+end
+
+print("Startup (average time): " .. average/N)
+
+)*****";
+
 //============================================================================
 // Memory consumption VarSetGet[100000]
 //============================================================================
@@ -145,17 +811,51 @@ static void dostr(lua_State *L, const char *str) {
 int main(int, char**) {
 	lua_State *L = luaL_newstate();
 	luaL_openlibs(L);
+	// with the default pause, the 5.3+ incremental collector falls behind
+	// userdata that has __gc and the returned values loops run out of memory
+#if LUA_VERSION_NUM >= 504
+	lua_gc(L, LUA_GCGEN, 0, 0);
+#elif LUA_VERSION_NUM == 503
+	lua_gc(L, LUA_GCSETPAUSE, 100);
+#endif
 
 	InterLua::GlobalNamespace(L).
+		Function("payload_cstr", payload_cstr).
+		Function("payload_view", payload_view).
+		Function("payload_string", payload_string).
+		Function("startup", startup).
+		Function("table_ref", table_ref).
+		Function("table_stackref", table_stackref).
+		Function("table_get", table_get).
+		Function("table_path", table_path).
+		Function("call_ref", call_ref).
+		Function("call_typed", call_typed).
+		Function("call_table", call_table).
+		Function("call_tuple", call_tuple).
+		Function("container_sum", container_sum).
+		Function("container_iota", container_iota).
+		Function("container_keys", container_keys).
+		Function("container_proxy", container_proxy).
+		CFunction("FloatBuffer", InterLua::Buffer<float>::Create).
 		Class<SetGet>("SetGet").
 			Constructor().
 			Function("set", &SetGet::set).
 			Function("get", &SetGet::get).
 		End().
+		Class<DirectSetGet>("DirectSetGet").
+			Constructor().
+			Function<INTERLUA_FP(&DirectSetGet::set)>("set").
+			Function<INTERLUA_FP(&DirectSetGet::get)>("get").
+		End().
 		Class<VarSetGet>("VarSetGet").
 			Constructor().
 			Variable("n", &VarSetGet::n).
 		End().
+		Class<FieldSetGet>("FieldSetGet").
+			Fields().
+			Constructor().
+			Variable("n", &FieldSetGet::n).
+		End().
 		Class<Base>("Base").
 			Constructor().
 			Function("increment_a_base", &Base::increment_a_base).
@@ -164,11 +864,71 @@ int main(int, char**) {
 		DerivedClass<Derived, Base>("Derived").
 			Constructor().
 		End().
+		DerivedClass<TrustedSetGet, SetGet>("TrustedSetGet").Trusted().
+			Constructor().
+			Function("set", &SetGet::set).
+			Function("get", &SetGet::get).
+		End().
+		DerivedClass<TrustedDerived, Derived>("TrustedDerived").Trusted().
+			Constructor().
+			Function("increment_a_base", &Base::increment_a_base).
+		End().
+		Class<Vec3>("Vec3").
+			Constructor<double, double, double>().
+			Function("add", &Vec3::add).
+			Operator("__add", &Vec3::add).
+			Function("get_x", &Vec3::get_x).
+		End().
+		Class<Tree>("Tree").
+			Constructor().
+			Function("get_child", &Tree::get_child).
+		End().
+		Class<CachedTree>("CachedTree").
+			CachePointers().
+			Constructor().
+			Function("get_child", &CachedTree::get_child).
+		End().
+		Class<Block>("Block").
+			Constructor().
+			Function("next", &Block::next).
+		End().
+		Class<Mixed>("Mixed").
+			Constructor().
+			Function("add", &Mixed::add).
+			Function("add_ref", &Mixed::add_ref).
+			Function("get", &Mixed::get).
+		End().
+		Class<Level0>("Level0").
+			Constructor().
+			Function("increment_a_root", &Level0::increment_a_root).
+			Function("get_n", &Level0::get_n).
+		End().
+		DerivedClass<Level1, Level0>("Level1").Constructor().End().
+		DerivedClass<Level2, Level1>("Level2").Constructor().End().
+		DerivedClass<Level3, Level2>("Level3").Constructor().End().
+		DerivedClass<Level4, Level3>("Level4").Constructor().End().
+		DerivedClass<Level5, Level4>("Level5").Constructor().End().
+		DerivedClass<Level6, Level5>("Level6").Constructor().End().
 	End();
 
 	dostr(L, set_and_get);
+	dostr(L, direct_set_and_get);
 	dostr(L, var_set_and_get);
+	dostr(L, field_set_and_get);
 	dostr(L, derived_as_base);
+	dostr(L, mixed_arguments);
+	dostr(L, deep_hierarchy);
+	dostr(L, checked_vs_trusted);
+	dostr(L, returning_values);
+	dostr(L, returning_pointers);
+	dostr(L, string_arguments);
+	dostr(L, containers);
+	dostr(L, buffers);
+	pool_size = InterLua::Path(L, "pool.size");
+	dostr(L, table_access);
+	pool_size = InterLua::Path();
+	dostr(L, calling_lua);
+	dostr(L, startup_time);
 	//dostr(L, memory_consumption);
 	lua_close(L);
 }
@@ -59,12 +59,94 @@ static std::unique_ptr<char[]> asprintf(const char *format, ...) {
 	return s;
 }
 
+//============================================================================
+// Main thread
+//============================================================================
+
+#if LUA_VERSION_NUM < 502
+// lua 5.1 has no LUA_RIDX_MAINTHREAD, the main thread is kept in the registry
+// once it's seen, which is at the latest when the first binding is registered
+// from it (push_interned), main_thread only reads it afterwards
+static int main_thread_key;
+
+static void remember_main_thread(lua_State *L) {
+	if (lua_pushthread(L))
+		_interlua_rawsetp(L, LUA_REGISTRYINDEX, &main_thread_key);
+	else
+		lua_pop(L, 1);
+}
+#endif
+
+lua_State *main_thread(lua_State *L) {
+#if LUA_VERSION_NUM >= 502
+	lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+#else
+	_interlua_rawgetp(L, LUA_REGISTRYINDEX, &main_thread_key);
+	if (lua_isnil(L, -1)) {
+		// nothing was registered yet, 'L' is the main thread, unless
+		// it's a coroutine, then there is no better answer anyway
+		lua_pop(L, 1);
+		remember_main_thread(L);
+		return L;
+	}
+#endif
+	lua_State *main = lua_tothread(L, -1);
+	lua_pop(L, 1);
+	return main ? main : L;
+}
+
+//============================================================================
+// Interned keys
+//============================================================================
+
+static const char *const key_names[] = {
+	nullptr,
+	"__index",
+	"__newindex",
+	"__gc",
+	"__call",
+	"__mode",
+	"__type",
+	"__class",
+	"__const",
+	"__methods",
+	"__all_methods",
+	"__get",
+	"__all_get",
+	"__set",
+	"__all_set",
+	"__operators",
+	"__derived",
+};
+
+static_assert(sizeof(key_names) / sizeof(key_names[0]) == KeyEnd,
+	"key_names must match the Key enum");
+
+// the registry key of the interned keys table
+static int interned_key;
+
+void push_interned(lua_State *L) {
+	_interlua_rawgetp(L, LUA_REGISTRYINDEX, &interned_key);
+	if (!lua_isnil(L, -1))
+		return;
+	lua_pop(L, 1);
+
+#if LUA_VERSION_NUM < 502
+	remember_main_thread(L);
+#endif
+	lua_createtable(L, KeyEnd - 1, 0);
+	for (int i = 1; i < KeyEnd; i++) {
+		lua_pushstring(L, key_names[i]);
+		lua_rawseti(L, -2, i);
+	}
+	lua_pushvalue(L, -1);
+	_interlua_rawsetp(L, LUA_REGISTRYINDEX, &interned_key);
+}
+
 //============================================================================
 // class_info
 //============================================================================
 
-static_assert(sizeof(uintptr_t) == 4 || sizeof(uintptr_t) == 8,
-	"4 or 8 bytes uintptr_t size expected");
 constexpr uintptr_t class_info_magic =
 	(sizeof(uintptr_t) == 4)
 	? 0xA3867EF9
@@ -76,28 +158,60 @@ struct class_info {
 	class_info *parent;
 	bool is_const;
 
+	// the metatable this class_info is stored in, lua tables never move
+	const void *metatable = nullptr;
+
+	// ancestor display: ancestors[i] is the class_id of the ancestor at
+	// depth i, ancestors[depth] is the class_id of this class
+	int depth;
+	std::unique_ptr<void*[]> ancestors;
+
 	class_info(void *class_id, class_info *parent, bool is_const):
 		class_id(class_id),
 		parent(parent),
-		is_const(is_const)
+		is_const(is_const),
+		depth(parent ? parent->depth + 1 : 0),
+		ancestors(new (or_die) void*[depth+1])
 	{
+		for (int i = 0; i < depth; i++)
+			ancestors[i] = parent->ancestors[i];
+		ancestors[depth] = class_id;
 	}
 
 	bool is_valid() const { return magic == class_info_magic; }
+
+	// 'key_depth' is the depth of the 'key' class, see set_key_depth
+	bool is_derived_from(void *key, int key_depth) const {
+		return key_depth <= depth && ancestors[key_depth] == key;
+	}
 };
 
+// Each ClassKey points to an int, we store the depth of the class there. The
+// value is the same for all lua states as long as the class is registered with
+// the same base class. If it's not, the display check fails and get_userdata
+// falls back to walking the parent chain. A racing stale value is harmless for
+// the same reason, relaxed ordering is enough.
+static inline int get_key_depth(void *key) {
+	return static_cast<std::atomic<int>*>(key)->load(std::memory_order_relaxed);
+}
+static inline void set_key_depth(void *key, int depth) {
+	static_cast<std::atomic<int>*>(key)->store(depth, std::memory_order_relaxed);
+}
+
 static int class_info_gc(lua_State *L) {
 	auto cip = (class_info*)lua_touserdata(L, 1);
 	cip->~class_info();
 	return 0;
 }
 
-static void push_class_info(lua_State *L, class_info ci) {
+// the metatable the class_info belongs to is on top of the stack
+static void push_class_info(lua_State *L, class_info ci, int interned) {
+	ci.metatable = lua_topointer(L, -1);
 	void *mem = lua_newuserdata(L, sizeof(class_info));
 	new (mem) class_info(std::move(ci));
 	lua_newtable(L);
 	lua_pushcfunction(L, class_info_gc);
-	rawsetfield(L, -2, "__gc");
+	rawsetkey(L, -2, interned, KeyGC);
 	lua_setmetatable(L, -2);
 }
 
@@ -149,6 +263,20 @@ void stack_dump(lua_State *L) {
       printf("----------------------------\n");
 }
 
+bool is_operator_name(const char *name) {
+	static const char *const names[] = {
+		"__add", "__sub", "__mul", "__div", "__mod", "__pow", "__unm",
+		"__idiv", "__band", "__bor", "__bxor", "__shl", "__shr", "__bnot",
+		"__eq", "__lt", "__le",
+		"__len", "__concat", "__call", "__tostring",
+	};
+	for (auto n : names) {
+		if (strcmp(name, n) == 0)
+			return true;
+	}
+	return false;
+}
+
 static class_info *get_class_info_for(lua_State *L, void *key) {
 	if (key == nullptr)
 		return nullptr;
@@ -167,39 +295,169 @@ static class_info *get_class_info_for(lua_State *L, void *key) {
 
 static int userdata_gc(lua_State *L) {
 	auto ud = reinterpret_cast<Userdata*>(lua_touserdata(L, 1));
-	ud->~Userdata();
+	if (ud->destroy)
+		(*ud->destroy)(ud);
 	return 0;
 }
 
-static void push_parent_index(lua_State *L, void *key) {
-	_interlua_rawgetp(L, LUA_REGISTRYINDEX, key);
+//============================================================================
+// Flattening
+//============================================================================
+
+// Class and const metatables keep what was registered for the class itself in
+// the "own" tables (__methods, __get, __set). Lookups go to the "all" tables,
+// which also contain everything inherited, so that a method defined many
+// levels up is still found with a single lookup.
+static const Key flat_tables[][2] = {
+	{KeyMethods, KeyAllMethods},
+	{KeyGet, KeyAllGet},
+	{KeySet, KeyAllSet},
+};
+
+static void clear_table(lua_State *L, int t) {
+	t = _interlua_absindex(L, t);
+	lua_pushnil(L);
+	while (lua_next(L, t)) {
+		lua_pop(L, 1);
+		lua_pushvalue(L, -1);
+		lua_pushnil(L);
+		lua_rawset(L, t);
+	}
+}
+
+static void copy_table(lua_State *L, int from, int to) {
+	from = _interlua_absindex(L, from);
+	to = _interlua_absindex(L, to);
+	lua_pushnil(L);
+	while (lua_next(L, from)) {
+		lua_pushvalue(L, -2);
+		lua_insert(L, -2);
+		lua_rawset(L, to);
+	}
+}
+
+// refills the "all" tables of the metatable at 'mt' from the own tables of the
+// class and its ancestors, then does the same for the derived classes
+static void flatten(lua_State *L, int mt, int interned) {
+	// each level of derived classes keeps 2 slots, 5 more are used below
+	luaL_checkstack(L, 8, "class hierarchy too deep");
+	mt = _interlua_absindex(L, mt);
+	lua_rawgeti(L, mt, 1);
+	auto cip = to_class_info(L, -1);
+	lua_pop(L, 1);
+
+	for (auto names : flat_tables) {
+		rawgetkey(L, mt, interned, names[1]);
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			continue;
+		}
+		clear_table(L, -1);
+		for (int i = 0; i <= cip->depth; i++) {
+			_interlua_rawgetp(L, LUA_REGISTRYINDEX, cip->ancestors[i]);
+			rawgetkey(L, -1, interned, names[0]);
+			if (!lua_isnil(L, -1))
+				copy_table(L, -1, -3);
+			lua_pop(L, 2);
+		}
+		lua_pop(L, 1);
+	}
+
+	// operators go to the metatable itself, they are never removed, so
+	// it's enough to copy them over
+	for (int i = 0; i <= cip->depth; i++) {
+		_interlua_rawgetp(L, LUA_REGISTRYINDEX, cip->ancestors[i]);
+		rawgetkey(L, -1, interned, KeyOperators);
+		copy_table(L, -1, mt);
+		lua_pop(L, 2);
+	}
+
+	rawgetkey(L, mt, interned, KeyDerived);
+	int n = _interlua_rawlen(L, -1);
+	for (int i = 1; i <= n; i++) {
+		lua_rawgeti(L, -1, i);
+		flatten(L, -1, interned);
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+}
+
+void flatten_class(lua_State *L, int interned) {
+	flatten(L, -3, interned);
+	flatten(L, -2, interned);
+}
+
+// adds the metatable at 'mt' to the "__derived" list of the parent metatable
+static void add_derived(lua_State *L, int mt, void *parent_key, int interned) {
+	mt = _interlua_absindex(L, mt);
+	_interlua_rawgetp(L, LUA_REGISTRYINDEX, parent_key);
 	if (lua_isnil(L, -1)) {
 		die("should never happen");
 	}
+	rawgetkey(L, -1, interned, KeyDerived);
+	lua_pushvalue(L, mt);
+	lua_rawseti(L, -2, _interlua_rawlen(L, -2) + 1);
+	lua_pop(L, 2);
+}
+
+// Class and const metatables keep the class_info at [1] and the pointer cache
+// (see CWrapper::CachePointers) at [2], the cache is looked up on every push,
+// an integer key is the cheapest one
+static const int cache_slot = 2;
+
+static std::atomic<int> last_class_id;
+
+int next_class_id() {
+	return ++last_class_id;
+}
+
+// the registry key of the class table
+static int class_table_key;
+
+void push_class_table(lua_State *L) {
+	_interlua_rawgetp(L, LUA_REGISTRYINDEX, &class_table_key);
+	if (!lua_isnil(L, -1))
+		return;
+	lua_pop(L, 1);
 
-	rawgetfield(L, -1, "__index");
-	lua_remove(L, -2);
+	lua_newtable(L);
+	lua_pushvalue(L, -1);
+	_interlua_rawsetp(L, LUA_REGISTRYINDEX, &class_table_key);
 }
 
-void register_class_tables(lua_State *L, const char *name, const class_keys &keys) {
+// puts the metatable on top of the stack into the class table under 'id'
+static void add_to_class_table(lua_State *L, int id) {
+	push_class_table(L);
+	lua_pushvalue(L, -2);
+	lua_rawseti(L, -2, id);
+	lua_pop(L, 1);
+}
+
+static void push_new_metatable(lua_State *L, int interned) {
+	lua_newtable(L);
+
+	lua_newtable(L);
+	rawsetkey(L, -2, interned, KeyMethods);
+	lua_newtable(L);
+	lua_pushvalue(L, -1);
+	rawsetkey(L, -3, interned, KeyAllMethods);
+	rawsetkey(L, -2, interned, KeyIndex);
+	lua_newtable(L);
+	rawsetkey(L, -2, interned, KeyDerived);
+	lua_newtable(L);
+	rawsetkey(L, -2, interned, KeyOperators);
+}
+
+void register_class_tables(lua_State *L, const char *name, const class_keys &keys, int interned) {
 	// TODO: method: .HideMetatable() or .HiddenMetatable()
 	// lua_pushnil(L);
 	// rawsetfield(L, -2, "__metatable");
 
 	// === CONST METATABLE ===
-	lua_newtable(L);
+	push_new_metatable(L, interned);
 
 	lua_pushfstring(L, "const %s", name);
-	rawsetfield(L, -2, "__type");
-
-	lua_newtable(L);
-	if (keys.parent) {
-		lua_pushvalue(L, -1);
-		lua_setmetatable(L, -2);
-		push_parent_index(L, keys.parent->const_key);
-		rawsetfield(L, -2, "__index");
-	}
-	rawsetfield(L, -2, "__index");
+	rawsetkey(L, -2, interned, KeyType);
 
 	push_class_info(L, {
 		keys.const_key,
@@ -207,27 +465,20 @@ void register_class_tables(lua_State *L, const char *name, const class_keys &key
 			? get_class_info_for(L, keys.parent->const_key)
 			: nullptr,
 		true,
-	});
+	}, interned);
+	set_key_depth(keys.const_key, to_class_info(L, -1)->depth);
 	lua_rawseti(L, -2, 1);
+	add_to_class_table(L, keys.const_id);
 
 	// === CLASS METATABLE ===
-	lua_newtable(L);
+	push_new_metatable(L, interned);
 
 	lua_pushstring(L, name);
-	rawsetfield(L, -2, "__type");
-
-	lua_newtable(L);
-	if (keys.parent) {
-		lua_pushvalue(L, -1);
-		lua_setmetatable(L, -2);
-		push_parent_index(L, keys.parent->class_key);
-		rawsetfield(L, -2, "__index");
-	}
-	rawsetfield(L, -2, "__index");
+	rawsetkey(L, -2, interned, KeyType);
 
 	// a pointer to the const table, mutable value can become a const value
 	lua_pushvalue(L, -2);
-	rawsetfield(L, -2, "__const");
+	rawsetkey(L, -2, interned, KeyConst);
 
 	push_class_info(L, {
 		keys.class_key,
@@ -235,8 +486,10 @@ void register_class_tables(lua_State *L, const char *name, const class_keys &key
 			? get_class_info_for(L, keys.parent->class_key)
 			: nullptr,
 		false,
-	});
+	}, interned);
+	set_key_depth(keys.class_key, to_class_info(L, -1)->depth);
 	lua_rawseti(L, -2, 1);
+	add_to_class_table(L, keys.class_id);
 
 	// === STATIC METATABLE ===
 	lua_newtable(L);
@@ -244,21 +497,21 @@ void register_class_tables(lua_State *L, const char *name, const class_keys &key
 	lua_setmetatable(L, -2);
 	if (keys.parent) {
 		_interlua_rawgetp(L, LUA_REGISTRYINDEX, keys.parent->static_key);
-		rawsetfield(L, -2, "__index");
+		rawsetkey(L, -2, interned, KeyIndex);
 	}
 
 	// a pointer to the class table, we need this in Class registration
 	// function to reuse the tables in case if the same class is being
 	// registered twice
 	lua_pushvalue(L, -2);
-	rawsetfield(L, -2, "__class");
+	rawsetkey(L, -2, interned, KeyClass);
 
 	// -- register GC meta methods --
 
 	lua_pushcfunction(L, userdata_gc);
-	rawsetfield(L, -3, "__gc");
+	rawsetkey(L, -3, interned, KeyGC);
 	lua_pushcfunction(L, userdata_gc);
-	rawsetfield(L, -4, "__gc");
+	rawsetkey(L, -4, interned, KeyGC);
 
 	// -- register metatables in the lua registry --
 	lua_pushvalue(L, -1);
@@ -267,12 +520,119 @@ void register_class_tables(lua_State *L, const char *name, const class_keys &key
 	_interlua_rawsetp(L, LUA_REGISTRYINDEX, keys.class_key);
 	lua_pushvalue(L, -3);
 	_interlua_rawsetp(L, LUA_REGISTRYINDEX, keys.const_key);
+
+	if (!keys.parent)
+		return;
+
+	add_derived(L, -3, keys.parent->const_key, interned);
+	add_derived(L, -2, keys.parent->class_key, interned);
+
+	// field syntax and pointer cache are inherited
+	_interlua_rawgetp(L, LUA_REGISTRYINDEX, keys.parent->class_key);
+	rawgetkey(L, -1, interned, KeyGet);
+	lua_rawgeti(L, -2, cache_slot);
+	bool fields = !lua_isnil(L, -2);
+	bool cache = !lua_isnil(L, -1);
+	lua_pop(L, 3);
+	if (fields)
+		enable_fields(L, interned);
+	if (cache)
+		enable_pointer_cache(L, interned);
+
+	// inherit what was registered for the parent so far
+	flatten_class(L, interned);
+}
+
+//============================================================================
+// Fields
+//============================================================================
+
+// pushes table[key], where key is at 2
+static inline bool push_field(lua_State *L, int table) {
+	lua_pushvalue(L, 2);
+	lua_rawget(L, table);
+	return !lua_isnil(L, -1);
+}
+
+static int field_index(lua_State *L) {
+	if (push_field(L, lua_upvalueindex(1))) {
+		auto fa = (const field_accessor*)lua_touserdata(L, -1);
+		return (*fa->call)(L, fa);
+	}
+	lua_pop(L, 1);
+
+	// not a field, try methods
+	push_field(L, lua_upvalueindex(2));
+	return 1;
+}
+
+static int field_newindex(lua_State *L) {
+	// const metatables have no setters
+	if (!lua_isnil(L, lua_upvalueindex(1))) {
+		if (push_field(L, lua_upvalueindex(1))) {
+			auto fa = (const field_accessor*)lua_touserdata(L, -1);
+			return (*fa->call)(L, fa);
+		}
+		lua_pop(L, 1);
+	}
+
+	const char *name = lua_type(L, 2) == LUA_TSTRING
+		? lua_tostring(L, 2)
+		: luaL_typename(L, 2);
+	if (push_field(L, lua_upvalueindex(2)))
+		return luaL_error(L, "'%s' is read-only", name);
+
+	lua_getmetatable(L, 1);
+	rawgetfield(L, -1, "__type");
+	return luaL_error(L, "'%s' is not a field of '%s'",
+		name, lua_tostring(L, -1));
+}
+
+// creates the own table 'name' and the "all" table 'all_name' in the metatable
+// at 'mt' and leaves the latter on the stack
+static void push_new_field_tables(lua_State *L, int mt, int interned, Key name, Key all_name) {
+	lua_newtable(L);
+	rawsetkey(L, mt, interned, name);
+	lua_newtable(L);
+	lua_pushvalue(L, -1);
+	rawsetkey(L, mt, interned, all_name);
+}
+
+static void enable_fields_for(lua_State *L, int mt, bool is_const, int interned) {
+	mt = _interlua_absindex(L, mt);
+
+	// __index: getters, methods
+	push_new_field_tables(L, mt, interned, KeyGet, KeyAllGet);
+	rawgetkey(L, mt, interned, KeyAllMethods);
+	lua_pushcclosure(L, field_index, 2);
+	rawsetkey(L, mt, interned, KeyIndex);
+
+	// __newindex: setters, getters
+	if (is_const)
+		lua_pushnil(L);
+	else
+		push_new_field_tables(L, mt, interned, KeySet, KeyAllSet);
+	rawgetkey(L, mt, interned, KeyAllGet);
+	lua_pushcclosure(L, field_newindex, 2);
+	rawsetkey(L, mt, interned, KeyNewIndex);
+}
+
+void enable_fields(lua_State *L, int interned) {
+	rawgetkey(L, -2, interned, KeyGet);
+	bool enabled = !lua_isnil(L, -1);
+	lua_pop(L, 1);
+	if (enabled)
+		return;
+
+	enable_fields_for(L, -3, true, interned);
+	enable_fields_for(L, -2, false, interned);
+	flatten_class(L, interned);
 }
 
 NSWrapper NSWrapper::Namespace(const char *name) {
 	rawgetfield(L, -1, name);
 	if (!lua_isnil(L, -1))
-		return {L};
+		return {L, interned};
 
 	// pop nil left from the rawgetfield call above
 	lua_pop(L, 1);
@@ -280,10 +640,163 @@ NSWrapper NSWrapper::Namespace(const char *name) {
 	lua_newtable(L);
 	lua_pushvalue(L, -1);
 	rawsetfield(L, -3, name);
-	return {L};
+	return {L, interned};
+}
+
+// same as set_class_metatable, but the metatable is on top of the stack
+static class_info *set_pushed_metatable(lua_State *L) {
+	if (lua_isnil(L, -1)) {
+		die("pushing an unregistered class onto the lua stack");
+	}
+	lua_rawgeti(L, -1, 1);
+	auto cip = to_class_info(L, -1);
+	lua_pop(L, 1);
+	lua_setmetatable(L, -2);
+	return cip;
+}
+
+class_info *set_class_metatable(lua_State *L, void *key) {
+	_interlua_rawgetp(L, LUA_REGISTRYINDEX, key);
+	return set_pushed_metatable(L);
+}
+
+class_info *set_class_metatable(lua_State *L, int classes, int id) {
+	lua_rawgeti(L, classes, id);
+	return set_pushed_metatable(L);
+}
+
+//============================================================================
+// Pointer cache
+//============================================================================
+
+static void add_pointer_cache(lua_State *L, int mt, int interned) {
+	mt = _interlua_absindex(L, mt);
+	lua_rawgeti(L, mt, cache_slot);
+	bool enabled = !lua_isnil(L, -1);
+	lua_pop(L, 1);
+	if (enabled)
+		return;
+
+	lua_newtable(L);
+	lua_newtable(L);
+	lua_pushstring(L, "v");
+	rawsetkey(L, -2, interned, KeyMode);
+	lua_setmetatable(L, -2);
+	lua_rawseti(L, mt, cache_slot);
 }
 
-Userdata::~Userdata() {}
+void enable_pointer_cache(lua_State *L, int interned) {
+	add_pointer_cache(L, -3, interned);
+	add_pointer_cache(L, -2, interned);
+}
+
+// same as push_userdata_pointer, but the metatable is on top of the stack, it's
+// replaced by the userdata
+static void push_pointer_with_metatable(lua_State *L, void *ptr) {
+	if (lua_isnil(L, -1)) {
+		die("pushing an unregistered class onto the lua stack");
+	}
+	lua_rawgeti(L, -1, cache_slot);
+	bool cached = !lua_isnil(L, -1);
+	if (cached) {
+		_interlua_rawgetp(L, -1, ptr);
+		if (!lua_isnil(L, -1)) {
+			lua_replace(L, -3);
+			lua_pop(L, 1);
+			return;
+		}
+		lua_pop(L, 1);
+	}
+
+	// -1 cache or nil, -2 metatable
+	auto ud = new (lua_newuserdata(L, sizeof(Userdata))) Userdata;
+	ud->data = ptr;
+	lua_rawgeti(L, -3, 1);
+	ud->info = to_class_info(L, -1);
+	lua_pop(L, 1);
+	lua_pushvalue(L, -3);
+	lua_setmetatable(L, -2);
+	if (cached) {
+		lua_pushvalue(L, -1);
+		_interlua_rawsetp(L, -3, ptr);
+	}
+	lua_replace(L, -3);
+	lua_pop(L, 1);
+}
+
+void push_userdata_pointer(lua_State *L, void *key, void *ptr) {
+	_interlua_rawgetp(L, LUA_REGISTRYINDEX, key);
+	push_pointer_with_metatable(L, ptr);
+}
+
+void push_userdata_pointer(lua_State *L, int classes, int id, void *ptr) {
+	lua_rawgeti(L, classes, id);
+	push_pointer_with_metatable(L, ptr);
+}
+
+// removes the entry for 'ptr' from the cache of the metatable on top of the
+// stack, if 'index' is given, the entry is removed only if it's the userdata
+// at that (absolute) index
+static void evict_from_cache(lua_State *L, void *ptr, int index = 0) {
+	lua_rawgeti(L, -1, cache_slot);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		return;
+	}
+	_interlua_rawgetp(L, -1, ptr);
+	if (!index || lua_rawequal(L, -1, index)) {
+		lua_pushnil(L);
+		_interlua_rawsetp(L, -3, ptr);
+	}
+	lua_pop(L, 2);
+}
+
+void evict_userdata_pointer(lua_State *L, void *class_key, void *const_key, void *ptr) {
+	void *keys[] = {class_key, const_key};
+	for (void *key : keys) {
+		_interlua_rawgetp(L, LUA_REGISTRYINDEX, key);
+		if (!lua_isnil(L, -1))
+			evict_from_cache(L, ptr);
+		lua_pop(L, 1);
+	}
+}
+
+// converts userdata under 'index' to Userdata* safely, returns nullptr if the
+// userdata wasn't created by interlua
+static Userdata *to_userdata(lua_State *L, int index) {
+	auto ud = reinterpret_cast<Userdata*>(lua_touserdata(L, index));
+	if (ud && _interlua_rawlen(L, index) >= sizeof(Userdata) &&
+		ud->magic == userdata_magic && ud->info)
+		return ud;
+	return nullptr;
+}
+
+void make_const(lua_State *L, int index) {
+	index = _interlua_absindex(L, index);
+	auto ud = to_userdata(L, index);
+	if (!ud || !lua_getmetatable(L, index))
+		return;
+
+	rawgetfield(L, -1, "__const");
+	if (lua_isnil(L, -1)) {
+		// already const
+		lua_pop(L, 2);
+		return;
+	}
+
+	// the userdata isn't the one pushed for a mutable pointer anymore
+	lua_pushvalue(L, -2);
+	evict_from_cache(L, ud->data, index);
+	lua_pop(L, 1);
+
+	lua_rawgeti(L, -1, 1);
+	auto cip = to_class_info(L, -1);
+	lua_pop(L, 1);
+	lua_setmetatable(L, index);
+	lua_pop(L, 1);
+	if (cip)
+		ud->info = cip;
+}
 
 // expects 'absidx' metatable on top of the stack
 static void get_userdata_error(lua_State *L, int absidx, int idx,
@@ -314,9 +827,43 @@ static void get_userdata_error(lua_State *L, int absidx, int idx,
 	lua_pop(L, popn);
 }
 
+// A mutable value can be made const by setting its metatable to the "__const"
+// one without make_const, the cached class_info is stale then. Only matters
+// when a mutable value is required, the slow path reports the error.
+static bool swapped_metatable(lua_State *L, int idx, class_info *cip) {
+	if (!lua_getmetatable(L, idx))
+		return true;
+	const bool swapped = lua_topointer(L, -1) != cip->metatable;
+	lua_pop(L, 1);
+	return swapped;
+}
+
+Userdata *try_get_userdata(lua_State *L, int idx,
+	void *base_key, void *base_const_key, bool can_be_const)
+{
+	// the userdata header knows its class_info, no need to touch the
+	// metatable
+	if (auto ud = to_userdata(L, idx)) {
+		class_info *cip = ud->info;
+		if (!cip->is_const || can_be_const) {
+			void *key = cip->is_const ? base_const_key : base_key;
+			if (cip->is_derived_from(key, get_key_depth(key)) &&
+				(can_be_const || !swapped_metatable(L, idx, cip)))
+				return ud;
+		}
+	}
+	return nullptr;
+}
+
 Userdata *get_userdata(lua_State *L, int idx,
 	void *base_key, void *base_const_key, bool can_be_const, Error *err)
 {
+	// fast path, doesn't touch the error unless there is one
+	if (auto ud = try_get_userdata(L, idx, base_key, base_const_key, can_be_const))
+		return ud;
+
+	// slow path, it's either a foreign value or an error, the code below
+	// figures out which one and reports it
 	const int absidx = _interlua_absindex(L, idx);
 
 	// is it userdata?
@@ -366,20 +913,21 @@ Userdata *get_userdata(lua_State *L, int idx,
 		base_key = base_const_key;
 	}
 
-	for (;;) {
-		if (cip->class_id == base_key) {
+	// The display check failed, but the depth stored in the key might
+	// come from a registration with a different base class in another
+	// lua state, walking the parent chain is the definitive answer.
+	for (auto p = cip; p; p = p->parent) {
+		if (p->class_id == base_key) {
 			lua_pop(L, 2); // pop the class_info and the metatable
 			return ud;
 		}
-		cip = cip->parent;
-		if (cip == nullptr) {
-			lua_insert(L, -2);
-			get_userdata_error(L, absidx, idx, base_key,
-				"class mismatch, \"%s\" expected, got \"%s\" instead", err);
-			lua_pop(L, 1); // pop the class_info
-			return nullptr;
-		}
 	}
+
+	lua_insert(L, -2);
+	get_userdata_error(L, absidx, idx, base_key,
+		"class mismatch, \"%s\" expected, got \"%s\" instead", err);
+	lua_pop(L, 1); // pop the class_info
+	return nullptr;
 }
 
 Error::~Error() {
@@ -455,14 +1003,14 @@ void argerror(lua_State *L, int narg, const char *extra, Error *err) {
 	if (strcmp(ar.namewhat, "method") == 0) {
 		narg--; // do not count 'self'
 		if (narg == 0) {
-			err->Set(LUA_ERRRUN, "%s" "calling " LUA_QS " on bad self (%s)",
+			err->Set(LUA_ERRRUN, "%s" "calling '%s' on bad self (%s)",
 				loc.get(), ar.name, extra);
 			return;
 		}
 	}
 	if (ar.name == nullptr)
 		ar.name = "?";
-	err->Set(LUA_ERRRUN, "%s" "bad argument #%d to " LUA_QS " (%s)",
+	err->Set(LUA_ERRRUN, "%s" "bad argument #%d to '%s' (%s)",
 		loc.get(), narg, ar.name, extra);
 }
 
@@ -479,7 +1027,12 @@ void checkinteger(lua_State *L, int narg, Error *err) {
 #else
 	int isnum;
 	lua_tointegerx(L, narg, &isnum);
-	if (!isnum)
+	if (isnum)
+		return;
+	// since 5.3 a float like 3.5 is a number, but not an integer
+	if (lua_isnumber(L, narg))
+		argerror(L, narg, "number has no integer representation", err);
+	else
 		tag_error(L, narg, LUA_TNUMBER, err);
 #endif
 }
@@ -503,15 +1056,20 @@ void checkstring(lua_State *L, int narg, Error *err) {
 		tag_error(L, narg, LUA_TSTRING, err);
 }
 
-void ManualError::LJCheckAndDestroy(lua_State *L) {
-	Error *err = Get();
-	if (*err) {
-		lua_pushstring(L, err->What());
-		Destroy();
-		lua_error(L);
-	} else {
-		Destroy();
-	}
+void checktable(lua_State *L, int narg, Error *err) {
+	if (lua_type(L, narg) != LUA_TTABLE)
+		tag_error(L, narg, LUA_TTABLE, err);
+}
+
+void checkfunction(lua_State *L, int narg, Error *err) {
+	if (lua_type(L, narg) != LUA_TFUNCTION)
+		tag_error(L, narg, LUA_TFUNCTION, err);
+}
+
+void ManualError::LJRaise(lua_State *L) {
+	lua_pushstring(L, Get()->What());
+	Destroy();
+	lua_error(L);
 }
 
 } // namespace InterLua
@@ -3,13 +3,18 @@
 #include <lua.hpp>
 #include <type_traits>
 #include <utility>
+#include <tuple>
 #include <new>
 #include <cstdint>
 #include <cstddef>
 #include <cstring>
+#include <cstdlib>
+#include <functional>
+#include <atomic>
 
 //----------------------------------------------------------------------------
-// Workarounds for Lua versions prior to 5.2
+// Workarounds for Lua versions prior to 5.2, 5.2 and later (5.3 and 5.4
+// included) share the API used here
 //----------------------------------------------------------------------------
 #if LUA_VERSION_NUM < 502
 //----------------------------------------------------------------------------
@@ -57,6 +62,8 @@ inline size_t _interlua_rawlen(lua_State *L, int idx) {
 
 #define _INTERLUA_OK 0
 #define _interlua_pushglobaltable(L) lua_pushvalue(L, LUA_GLOBALSINDEX)
+#define _interlua_getuservalue lua_getfenv
+#define _interlua_setuservalue lua_setfenv
 
 //----------------------------------------------------------------------------
 #else
@@ -72,6 +79,8 @@ inline size_t _interlua_rawlen(lua_State *L, int idx) {
 #define _interlua_rawlen lua_rawlen
 #define _INTERLUA_OK LUA_OK
 #define _interlua_pushglobaltable lua_pushglobaltable
+#define _interlua_getuservalue lua_getuservalue
+#define _interlua_setuservalue lua_setuservalue
 
 //----------------------------------------------------------------------------
 #endif
@@ -86,6 +95,10 @@ namespace InterLua {
 void die(const char *str, ...);
 void stack_dump(lua_State *L);
 
+// true for the metamethods CWrapper::Operator accepts: arithmetic, bitwise,
+// comparison, "__len", "__concat", "__call" and "__tostring"
+bool is_operator_name(const char *name);
+
 // pushes t[key] onto the stack, where t is the table at the given index
 static inline void rawgetfield(lua_State *L, int index, const char *key) {
 	index = _interlua_absindex(L, index);
@@ -102,6 +115,52 @@ static inline void rawsetfield(lua_State *L, int index, const char *key) {
 	lua_rawset(L, index);
 }
 
+// Well-known keys interlua reads and writes. Each state keeps them in a table
+// of pre-interned strings (see push_interned), a key is pushed with
+// lua_rawgeti instead of hashing the C string again in lua_pushstring.
+enum Key {
+	KeyIndex = 1,
+	KeyNewIndex,
+	KeyGC,
+	KeyCall,
+	KeyMode,
+	KeyType,
+	KeyClass,
+	KeyConst,
+	KeyMethods,
+	KeyAllMethods,
+	KeyGet,
+	KeyAllGet,
+	KeySet,
+	KeyAllSet,
+	KeyOperators,
+	KeyDerived,
+	KeyEnd,
+};
+
+// pushes the table of pre-interned keys of the state, indexed by Key
+void push_interned(lua_State *L);
+
+// returns the main thread of the state, unlike coroutines it lives as long as
+// the state does, handles stored for later use have to be bound to it
+lua_State *main_thread(lua_State *L);
+
+// same as rawgetfield, 'interned' is the absolute index of the table pushed
+// by push_interned
+static inline void rawgetkey(lua_State *L, int index, int interned, Key key) {
+	index = _interlua_absindex(L, index);
+	lua_rawgeti(L, interned, key);
+	lua_rawget(L, index);
+}
+
+// same as rawsetfield, see rawgetkey
+static inline void rawsetkey(lua_State *L, int index, int interned, Key key) {
+	index = _interlua_absindex(L, index);
+	lua_rawgeti(L, interned, key);
+	lua_insert(L, -2);
+	lua_rawset(L, index);
+}
+
 // RAII helper for popping things from the lua stack
 class stack_pop {
 	lua_State *L;
@@ -122,20 +181,44 @@ struct class_keys {
 	void *static_key;
 	void *class_key;
 	void *const_key;
+	int class_id;
+	int const_id;
 	parent_class_keys *parent;
 };
 
+// returns a new dense id, see ClassKey::ClassId
+int next_class_id();
+
+// pushes the class table of the state: the class and const metatables of all
+// registered classes indexed by their ids (see ClassKey::ClassId). Bound
+// functions keep it as an upvalue, pushing a returned object is an array
+// lookup instead of a registry one.
+void push_class_table(lua_State *L);
+
 // creates, registers and leaves these tables on the stack:
 //   -1 static table
 //   -2 class table
 //   -3 const table
-void register_class_tables(lua_State *L, const char *name, const class_keys &keys);
+void register_class_tables(lua_State *L, const char *name, const class_keys &keys, int interned);
 
+// Copies everything registered for the class and its ancestors into the lookup
+// tables of the class and const metatables at -2 and -3, then does the same
+// for all the derived classes. CWrapper calls it on End(), this way methods
+// are found with one lookup and reopening a base class updates its children.
+void flatten_class(lua_State *L, int interned);
+
+// The keys are addresses of static ints, interlua uses the ints themselves to
+// store the depth of the class in its inheritance chain. The ints are shared
+// by all lua states, hence atomic, states may live in different threads.
 template <typename T>
 struct ClassKey {
-	static void *Static() { static int value; return &value; }
-	static void *Class() { static int value; return &value; }
-	static void *Const() { static int value; return &value; }
+	static void *Static() { static std::atomic<int> value; return &value; }
+	static void *Class() { static std::atomic<int> value; return &value; }
+	static void *Const() { static std::atomic<int> value; return &value; }
+
+	// ids of the class and const metatables in the class table
+	static int ClassId() { static const int id = next_class_id(); return id; }
+	static int ConstId() { static const int id = next_class_id(); return id; }
 };
 
 //============================================================================
@@ -180,8 +263,15 @@ struct ManualError {
 	uint8_t storage[sizeof(Error)];
 	Error *Init() {	return new (&storage) Error; }
 	Error *Get() { return reinterpret_cast<Error*>(storage); }
-	void LJCheckAndDestroy(lua_State *L);
 	void Destroy() { Get()->~Error(); }
+	void LJRaise(lua_State *L);
+
+	// An error which wasn't set owns no memory, skipping the destructor on
+	// the success path is fine, this way it's just one inline comparison.
+	void LJCheckAndDestroy(lua_State *L) {
+		if (*Get())
+			LJRaise(L);
+	}
 };
 
 //============================================================================
@@ -196,40 +286,107 @@ void checkany(lua_State *L, int narg, Error *err);
 void checkinteger(lua_State *L, int narg, Error *err);
 void checknumber(lua_State *L, int narg, Error *err);
 void checkstring(lua_State *L, int narg, Error *err);
+void checktable(lua_State *L, int narg, Error *err);
+void checkfunction(lua_State *L, int narg, Error *err);
 
 //============================================================================
 // Userdata
 //============================================================================
 
+struct class_info;
+
+static_assert(sizeof(uintptr_t) == 4 || sizeof(uintptr_t) == 8,
+	"4 or 8 bytes uintptr_t size expected");
+constexpr uintptr_t userdata_magic =
+	(sizeof(uintptr_t) == 4)
+	? 0x5E81D3A7
+	: 0x5E81D3A7C40B6F19;
+
+// A header of every interlua userdata. There are no virtual methods, the
+// pointer to the object and its destructor are plain fields, which makes
+// Data() a simple load.
 class Userdata {
 public:
-	virtual ~Userdata();
-	virtual void *Data() = 0;
+	// magic and info are set by the code which creates the userdata, info
+	// caches the class_info of the userdata's metatable, which makes it
+	// possible to validate the type without touching the lua stack
+	uintptr_t magic = userdata_magic;
+	class_info *info = nullptr;
+
+	// points to the object, set by the derived class
+	void *data = nullptr;
+
+	// called by __gc, nullptr if there is nothing to destroy
+	void (*destroy)(Userdata*) = nullptr;
+
+	void *Data() const { return data; }
 };
 
+struct emplace_call_t {};
+
 template <typename T>
 class UserdataValue : public Userdata {
 	T value;
 
+	static void destroy_value(Userdata *ud) {
+		static_cast<UserdataValue<T>*>(ud)->~UserdataValue();
+	}
+
+	void init() {
+		data = (void*)&value;
+		if (!std::is_trivially_destructible<T>::value)
+			destroy = destroy_value;
+	}
+
 public:
 	template <typename ...Args>
-	UserdataValue(Args &&...args): value(std::forward<Args>(args)...) {}
-	virtual void *Data() override { return (void*)&value; }
-};
+	UserdataValue(Args &&...args): value(std::forward<Args>(args)...) { init(); }
 
-template <typename T>
-class UserdataPointer : public Userdata {
-	T *ptr;
+	// the value is initialized with the result of f(), the compiler elides
+	// the temporary, this way a value returned by a function is constructed
+	// right in the userdata memory
+	template <typename F>
+	UserdataValue(emplace_call_t, F &&f): value(f()) { init(); }
 
-public:
-	UserdataPointer(T *ptr): ptr(ptr) {}
-	virtual void *Data() override { return (void*)ptr; }
+	T &Value() { return value; }
 };
 
 Userdata *get_userdata(lua_State *L, int index,
 	void *base_key, void *base_const_key, bool can_be_const,
 	Error *err);
 
+// same as get_userdata, but it only does the fast header check, returns
+// nullptr if the value isn't a matching interlua class or it's not clear
+// whether it is, get_userdata gives the definitive answer in that case
+Userdata *try_get_userdata(lua_State *L, int index,
+	void *base_key, void *base_const_key, bool can_be_const);
+
+// sets the metatable registered under 'key' on the userdata at the top of the
+// stack, returns the class_info of that metatable
+class_info *set_class_metatable(lua_State *L, void *key);
+
+// same as above, the metatable is taken from the class table at 'classes' by
+// its id
+class_info *set_class_metatable(lua_State *L, int classes, int id);
+
+// pushes a pointer userdata with the metatable registered under 'key', if the
+// class caches pointers (see CWrapper::CachePointers), the userdata pushed
+// for the same pointer before is reused
+void push_userdata_pointer(lua_State *L, void *key, void *ptr);
+
+// same as above, the metatable is taken from the class table at 'classes' by
+// its id
+void push_userdata_pointer(lua_State *L, int classes, int id, void *ptr);
+
+// removes 'ptr' from the pointer caches of the metatables registered under
+// 'class_key' and 'const_key'
+void evict_userdata_pointer(lua_State *L, void *class_key, void *const_key, void *ptr);
+
+// switches the interlua userdata at 'index' to its const metatable, the
+// Userdata::info is updated accordingly, use it instead of setting the
+// "__const" metatable manually
+void make_const(lua_State *L, int index);
+
 template <typename T>
 static void check_class(lua_State *L, int index,
 	bool can_be_const, Error *err)
@@ -245,7 +402,7 @@ static inline T *get_class_unchecked(lua_State *L, int index) {
 }
 
 template <typename T>
-static inline T *lj_get_class(lua_State *L, int index, bool can_be_const) {
+static T *lj_get_class_slow(lua_State *L, int index, bool can_be_const) {
 	ManualError merr;
 	Error *err = merr.Init();
 	auto ud = get_userdata(L, index,
@@ -255,6 +412,18 @@ static inline T *lj_get_class(lua_State *L, int index, bool can_be_const) {
 	return reinterpret_cast<T*>(ud->Data());
 }
 
+template <typename T>
+static inline T *lj_get_class(lua_State *L, int index, bool can_be_const) {
+	auto ud = try_get_userdata(L, index,
+		ClassKey<T>::Class(), ClassKey<T>::Const(),
+		can_be_const);
+	if (ud)
+		return reinterpret_cast<T*>(ud->Data());
+
+	// the error state is created on the slow path only
+	return lj_get_class_slow<T>(L, index, can_be_const);
+}
+
 //============================================================================
 // Stack operations
 //============================================================================
@@ -292,14 +461,34 @@ struct StackOps {
 		// difference between T and T& and we need to leave a
 		// reasonable way of making copies when passing values to Lua.
 		// Hence, the decision is to always copy ref values, but pass
-		// pointers directly as UserdataPointer and respect the
-		// constness.
-		_interlua_rawgetp(L, LUA_REGISTRYINDEX, ClassKey<PURE_T>::Class());
-		if (lua_isnil(L, -1)) {
-			die("pushing an unregistered class onto the lua stack");
-		}
-		lua_setmetatable(L, -2);
-		new (mem) UserdataValue<PURE_T>(std::forward<T>(value));
+		// pointers directly (see push_userdata_pointer) and respect
+		// the constness.
+		auto ud = new (mem) UserdataValue<PURE_T>(std::forward<T>(value));
+		ud->info = set_class_metatable(L, ClassKey<PURE_T>::Class());
+		return 1;
+	}
+
+	// same as Push, but the value is constructed in place from 'args'
+	template <typename ...Args>
+	static inline PURE_T &Emplace(lua_State *L, Args &&...args) {
+		void *mem = lua_newuserdata(L, sizeof(UserdataValue<PURE_T>));
+		auto ud = new (mem) UserdataValue<PURE_T>(std::forward<Args>(args)...);
+		ud->info = set_class_metatable(L, ClassKey<PURE_T>::Class());
+		return ud->Value();
+	}
+
+	// same as Push(L, f()), but the value returned by 'f' is constructed
+	// in place, the userdata is pushed before 'f' is called. 'classes' is
+	// the index of the class table (see push_class_table), 0 means the
+	// metatable is looked up in the registry.
+	template <typename F>
+	static inline int PushCall(lua_State *L, F &&f, int classes = 0) {
+		void *mem = lua_newuserdata(L, sizeof(UserdataValue<PURE_T>));
+		auto ud = new (mem) UserdataValue<PURE_T>(emplace_call_t(),
+			std::forward<F>(f));
+		ud->info = classes
+			? set_class_metatable(L, classes, ClassKey<PURE_T>::ClassId())
+			: set_class_metatable(L, ClassKey<PURE_T>::Class());
 		return 1;
 	}
 	static inline void Check(lua_State *L, int index, Error *err = &DefaultError) {
@@ -320,16 +509,23 @@ template <typename T>
 struct StackOps<T*> {
 	using PURE_T = typename std::decay<T>::type;
 	static inline int Push(lua_State *L, T *value) {
-		void *mem = lua_newuserdata(L, sizeof(UserdataPointer<T>));
 		void *mt = std::is_const<T>::value ?
 			ClassKey<PURE_T>::Const() :
 			ClassKey<PURE_T>::Class();
-		_interlua_rawgetp(L, LUA_REGISTRYINDEX, mt);
-		if (lua_isnil(L, -1)) {
-			die("pushing an unregistered class onto the lua stack");
-		}
-		lua_setmetatable(L, -2);
-		new (mem) UserdataPointer<T>(value);
+		push_userdata_pointer(L, mt, (void*)value);
+		return 1;
+	}
+
+	// same as Push(L, f()), 'classes' is the same as in StackOps<T>::PushCall
+	template <typename F>
+	static inline int PushCall(lua_State *L, F &&f, int classes = 0) {
+		T *value = f();
+		if (!classes)
+			return Push(L, value);
+		const int id = std::is_const<T>::value ?
+			ClassKey<PURE_T>::ConstId() :
+			ClassKey<PURE_T>::ClassId();
+		push_userdata_pointer(L, classes, id, (void*)value);
 		return 1;
 	}
 	static inline void Check(lua_State *L, int index, Error *err = &DefaultError) {
@@ -344,6 +540,23 @@ struct StackOps<T*> {
 	}
 };
 
+// Forgets the userdata cached for 'ptr' by a class with CWrapper::CachePointers
+// enabled. Call it when the object is destroyed, otherwise a new object
+// allocated at the same address is pushed as the old userdata. Only the cache
+// of T is affected, evict the pointer for each class it was pushed as.
+template <typename T>
+void Evict(lua_State *L, const T *ptr) {
+	evict_userdata_pointer(L, ClassKey<T>::Class(), ClassKey<T>::Const(),
+		(void*)ptr);
+}
+
+// Constructs a T from 'args' right in a new userdata on top of the stack,
+// returns a reference to it. T must be a registered class.
+template <typename T, typename ...Args>
+T &Emplace(lua_State *L, Args &&...args) {
+	return StackOps<T>::Emplace(L, std::forward<Args>(args)...);
+}
+
 template <>
 struct StackOps<std::nullptr_t> {
 	static inline int Push(lua_State *L, std::nullptr_t) {
@@ -359,21 +572,49 @@ struct StackOps<lua_State*> {
 	static inline lua_State *LJGet(lua_State *L, int) { return L; }
 };
 
+// Since lua 5.3 numbers have a 64-bit integer subtype and every integer type
+// goes through lua_Integer exactly (unsigned values above the signed maximum
+// wrap around, like in lua itself). Before 5.3 lua_Integer is ptrdiff_t and
+// all numbers are lua_Numbers: integers wider than ptrdiff_t and unsigned
+// integers as wide as it go through lua_Number directly, so that they are
+// neither truncated nor flip the sign, they are exact up to 2^53.
+template <typename T>
+struct integer_via_number :
+	std::integral_constant<
+		bool,
+		LUA_VERSION_NUM < 503 && (
+			sizeof(T) > sizeof(lua_Integer) || (
+				std::is_unsigned<T>::value &&
+				sizeof(T) == sizeof(lua_Integer)
+			)
+		)
+	> {};
+
 #define _stack_ops_integer(T)								\
 template <>										\
 struct StackOps<T> {									\
 	static inline int Push(lua_State *L, T value) {					\
-		lua_pushinteger(L, value);						\
+		if (integer_via_number<T>::value)					\
+			lua_pushnumber(L, (lua_Number)value);				\
+		else									\
+			lua_pushinteger(L, (lua_Integer)value);				\
 		return 1;								\
 	}										\
 	static inline void Check(lua_State *L, int index, Error *err = &DefaultError) {	\
-		checkinteger(L, index, err);						\
+		if (integer_via_number<T>::value)					\
+			checknumber(L, index, err);					\
+		else									\
+			checkinteger(L, index, err);					\
 	}										\
 	static inline T Get(lua_State *L, int index) {					\
-		return lua_tointeger(L, index);						\
+		if (integer_via_number<T>::value)					\
+			return (T)lua_tonumber(L, index);				\
+		return (T)lua_tointeger(L, index);					\
 	}										\
 	static inline T LJGet(lua_State *L, int index) {				\
-		return luaL_checkinteger(L, index);					\
+		if (integer_via_number<T>::value)					\
+			return (T)luaL_checknumber(L, index);				\
+		return (T)luaL_checkinteger(L, index);					\
 	}										\
 };
 
@@ -453,6 +694,51 @@ struct StackOps<char> {
 	}
 };
 
+// A non-owning view of a lua string. As an argument it's valid for the
+// duration of the call, the string is referenced by the lua stack. Unlike
+// const char* it knows the length: no strlen() on push and the string may
+// contain '\0' bytes.
+struct StringView {
+	const char *ptr = nullptr;
+	size_t len = 0;
+
+	StringView() = default;
+	StringView(const char *ptr, size_t len): ptr(ptr), len(len) {}
+	StringView(const char *str): ptr(str), len(str ? strlen(str) : 0) {}
+
+	bool operator==(const StringView &r) const {
+		return len == r.len && (len == 0 || memcmp(ptr, r.ptr, len) == 0);
+	}
+	bool operator!=(const StringView &r) const { return !operator==(r); }
+};
+
+template <>
+struct StackOps<StringView> {
+	static inline int Push(lua_State *L, StringView value) {
+		if (value.ptr)
+			lua_pushlstring(L, value.ptr, value.len);
+		else
+			lua_pushnil(L);
+		return 1;
+	}
+	static inline void Check(lua_State *L, int index, Error *err = &DefaultError) {
+		checkstring(L, index, err);
+	}
+	static inline StringView Get(lua_State *L, int index) {
+		StringView out;
+		out.ptr = lua_tolstring(L, index, &out.len);
+		return out;
+	}
+	static inline StringView LJGet(lua_State *L, int index) {
+		StringView out;
+		out.ptr = luaL_checklstring(L, index, &out.len);
+		return out;
+	}
+};
+
+template <> struct StackOps<const StringView&> : StackOps<StringView> {};
+template <> struct StackOps<StringView&&> : StackOps<StringView> {};
+
 template <>
 struct StackOps<bool> {
 	static inline int Push(lua_State *L, bool value) {
@@ -521,59 +807,117 @@ template<int N> struct make_index_impl {
 template<> struct make_index_impl<0> { using type = index_tuple_type<>; };
 template<int N> using index_tuple = typename make_index_impl<N>::type;
 
+// is_lj_safe<T>::value is true, if StackOps<Decay<T>>::Get returns a value
+// which doesn't need a destructor call: a reference, a pointer or a trivially
+// destructible value. A lua error (longjmp) can be raised safely while such
+// values are alive.
+template <typename T, typename G = decltype(StackOps<Decay<T>>::Get(nullptr, 0))>
+struct is_lj_safe :
+	std::integral_constant<
+		bool,
+		std::is_reference<G>::value ||
+		std::is_trivially_destructible<G>::value
+	> {};
+
 template <typename ...Args>
-struct is_all_pod : std::true_type {};
+struct is_all_lj_safe : std::true_type {};
 
-template <typename T>
-struct is_all_pod<T> :
+template <typename T, typename ...Args>
+struct is_all_lj_safe<T, Args...> :
 	std::integral_constant<
 		bool,
-		std::is_pod<T>::value
+		is_lj_safe<T>::value && is_all_lj_safe<Args...>::value
 	> {};
 
+// has_state_arg<Args...>::value is true, if one of the arguments is the
+// lua_State itself, such a function may look at or push onto the stack
+template <typename ...Args>
+struct has_state_arg : std::false_type {};
+
 template <typename T, typename ...Args>
-struct is_all_pod<T, Args...> :
+struct has_state_arg<T, Args...> :
 	std::integral_constant<
 		bool,
-		std::is_pod<T>::value && is_all_pod<Args...>::value
+		std::is_same<Decay<T>, lua_State*>::value ||
+		has_state_arg<Args...>::value
+	> {};
+
+// Defines how func_traits fetches the arguments from the lua stack.
+enum ArgsMode {
+	// recursive_check for all the arguments, then StackOps::Get, used when
+	// some of the arguments need a destructor call (Ref, class values)
+	ArgsChecked,
+	// StackOps::LJGet, a single pass which checks and gets each argument,
+	// raises a lua error right away, see is_lj_safe
+	ArgsLJChecked,
+	// StackOps::Get only, no validation at all, see CWrapper::Trusted
+	ArgsTrusted,
+};
+
+template <bool TRUSTED, typename ...Args>
+struct args_mode :
+	std::integral_constant<
+		ArgsMode,
+		TRUSTED ? ArgsTrusted :
+		is_all_lj_safe<Args...>::value ? ArgsLJChecked : ArgsChecked
 	> {};
 
-template <typename F, typename IT, bool POD>
+template <typename F, typename IT, ArgsMode M>
 struct func_traits;
 
-// is_pod == false
+// 'fp' of the call method is a function pointer or a functor (see
+// functor_call)
+
+// ArgsChecked
 template <typename R, typename ...Args, int ...I>
-struct func_traits<R (Args...), index_tuple_type<I...>, false> {
-	static R call(lua_State *L, R (*fp)(Args...)) {
+struct func_traits<R (Args...), index_tuple_type<I...>, ArgsChecked> {
+	template <typename F>
+	static R call(lua_State *L, F &&fp) {
 		(void)L; // silence notused warning for cases with no arguments
 		lj_recursive_check<1, Args...>(L);
-		return (*fp)(StackOps<Decay<Args>>::Get(L, I+1)...);
+		return fp(StackOps<Decay<Args>>::Get(L, I+1)...);
 	}
 
-	static void construct(lua_State *L, void *mem) {
+	static Userdata *construct(lua_State *L, void *mem) {
 		(void)L; // silence notused warning for cases with no arguments
 		lj_recursive_check<2, Args...>(L);
-		new (mem) UserdataValue<R>(StackOps<Decay<Args>>::Get(L, I+2)...);
+		return new (mem) UserdataValue<R>(StackOps<Decay<Args>>::Get(L, I+2)...);
+	}
+};
+
+// ArgsLJChecked
+template <typename R, typename ...Args, int ...I>
+struct func_traits<R (Args...), index_tuple_type<I...>, ArgsLJChecked> {
+	template <typename F>
+	static R call(lua_State *L, F &&fp) {
+		(void)L; // silence notused warning for cases with no arguments
+		return fp(StackOps<Decay<Args>>::LJGet(L, I+1)...);
+	}
+
+	static Userdata *construct(lua_State *L, void *mem) {
+		(void)L; // silence notused warning for cases with no arguments
+		return new (mem) UserdataValue<R>(StackOps<Decay<Args>>::LJGet(L, I+2)...);
 	}
 };
 
-// is_pod == true
+// ArgsTrusted
 template <typename R, typename ...Args, int ...I>
-struct func_traits<R (Args...), index_tuple_type<I...>, true> {
-	static R call(lua_State *L, R (*fp)(Args...)) {
+struct func_traits<R (Args...), index_tuple_type<I...>, ArgsTrusted> {
+	template <typename F>
+	static R call(lua_State *L, F &&fp) {
 		(void)L; // silence notused warning for cases with no arguments
-		return (*fp)(StackOps<Decay<Args>>::LJGet(L, I+1)...);
+		return fp(StackOps<Decay<Args>>::Get(L, I+1)...);
 	}
 
-	static void construct(lua_State *L, void *mem) {
+	static Userdata *construct(lua_State *L, void *mem) {
 		(void)L; // silence notused warning for cases with no arguments
-		new (mem) UserdataValue<R>(StackOps<Decay<Args>>::LJGet(L, I+2)...);
+		return new (mem) UserdataValue<R>(StackOps<Decay<Args>>::Get(L, I+2)...);
 	}
 };
 
-// is_pod == false
+// ArgsChecked
 template <typename T, typename R, typename ...Args, int ...I>
-struct func_traits<R (T::*)(Args...), index_tuple_type<I...>, false> {
+struct func_traits<R (T::*)(Args...), index_tuple_type<I...>, ArgsChecked> {
 	static R call(lua_State *L, T *cls, R (T::*fp)(Args...)) {
 		(void)L; // silence notused warning for cases with no arguments
 		lj_recursive_check<2, Args...>(L);
@@ -581,18 +925,27 @@ struct func_traits<R (T::*)(Args...), index_tuple_type<I...>, false> {
 	}
 };
 
-// is_pod == true
+// ArgsLJChecked
 template <typename T, typename R, typename ...Args, int ...I>
-struct func_traits<R (T::*)(Args...), index_tuple_type<I...>, true> {
+struct func_traits<R (T::*)(Args...), index_tuple_type<I...>, ArgsLJChecked> {
 	static R call(lua_State *L, T *cls, R (T::*fp)(Args...)) {
 		(void)L; // silence notused warning for cases with no arguments
 		return (cls->*fp)(StackOps<Decay<Args>>::LJGet(L, I+2)...);
 	}
 };
 
-// is_pod == false
+// ArgsTrusted
+template <typename T, typename R, typename ...Args, int ...I>
+struct func_traits<R (T::*)(Args...), index_tuple_type<I...>, ArgsTrusted> {
+	static R call(lua_State *L, T *cls, R (T::*fp)(Args...)) {
+		(void)L; // silence notused warning for cases with no arguments
+		return (cls->*fp)(StackOps<Decay<Args>>::Get(L, I+2)...);
+	}
+};
+
+// ArgsChecked
 template <typename T, typename R, typename ...Args, int ...I>
-struct func_traits<R (T::*)(Args...) const, index_tuple_type<I...>, false> {
+struct func_traits<R (T::*)(Args...) const, index_tuple_type<I...>, ArgsChecked> {
 	static R call(lua_State *L, const T *cls, R (T::*fp)(Args...) const) {
 		(void)L; // silence notused warning for cases with no arguments
 		lj_recursive_check<2, Args...>(L);
@@ -600,15 +953,24 @@ struct func_traits<R (T::*)(Args...) const, index_tuple_type<I...>, false> {
 	}
 };
 
-// is_pod == true
+// ArgsLJChecked
 template <typename T, typename R, typename ...Args, int ...I>
-struct func_traits<R (T::*)(Args...) const, index_tuple_type<I...>, true> {
+struct func_traits<R (T::*)(Args...) const, index_tuple_type<I...>, ArgsLJChecked> {
 	static R call(lua_State *L, const T *cls, R (T::*fp)(Args...) const) {
 		(void)L; // silence notused warning for cases with no arguments
 		return (cls->*fp)(StackOps<Decay<Args>>::LJGet(L, I+2)...);
 	}
 };
 
+// ArgsTrusted
+template <typename T, typename R, typename ...Args, int ...I>
+struct func_traits<R (T::*)(Args...) const, index_tuple_type<I...>, ArgsTrusted> {
+	static R call(lua_State *L, const T *cls, R (T::*fp)(Args...) const) {
+		(void)L; // silence notused warning for cases with no arguments
+		return (cls->*fp)(StackOps<Decay<Args>>::Get(L, I+2)...);
+	}
+};
+
 template <typename T>
 struct is_const_member_function;
 template <typename T, typename R, typename ...Args>
@@ -616,191 +978,613 @@ struct is_const_member_function<R (T::*)(Args...) const> : std::true_type {};
 template <typename T, typename R, typename ...Args>
 struct is_const_member_function<R (T::*)(Args...)> : std::false_type {};
 
-template <typename F>
+// free functions can be called with const objects as well, they check their
+// arguments themselves
+template <typename T>
+struct is_const_callable : std::integral_constant<bool,
+	!std::is_member_function_pointer<T>::value> {};
+template <typename T, typename R, typename ...Args>
+struct is_const_callable<R (T::*)(Args...) const> : std::true_type {};
+
+// returns the 'self' argument of a method call, trusted bindings skip the check
+template <typename T, bool TRUSTED>
+static inline T *get_self(lua_State *L, bool can_be_const) {
+	return TRUSTED
+		? get_class_unchecked<T>(L, 1)
+		: lj_get_class<T>(L, 1, can_be_const);
+}
+
+// Pushes the value returned by f(). Class values go through StackOps::PushCall
+// and are constructed right in the userdata instead of being moved there from
+// a temporary, a heavy value returned by a bound function is never copied.
+// PushCall allocates the userdata before f() runs, IN_PLACE is false for the
+// functions taking lua_State*, they must see the stack untouched. 'classes' is
+// the index of the class table or 0, see StackOps::PushCall.
+template <typename R, bool IN_PLACE = true, typename F>
+static inline auto push_call(lua_State *L, F &&f, int classes, int)
+	-> typename std::enable_if<IN_PLACE,
+		decltype(StackOps<R>::PushCall(L, std::forward<F>(f), classes))>::type
+{
+	return StackOps<R>::PushCall(L, std::forward<F>(f), classes);
+}
+
+template <typename R, bool IN_PLACE = true, typename F>
+static inline int push_call(lua_State *L, F &&f, int, long) {
+	return StackOps<R>::Push(L, f());
+}
+
+template <typename F, bool TRUSTED = false>
 struct call {};
 
 // ordinary function call wrapper
-template <typename R, typename ...Args>
-struct call<R (*)(Args...)> {
-	static int cfunction(lua_State *L) {
-		typedef R (*FP)(Args...);
-		auto fp = *(FP*)lua_touserdata(L, lua_upvalueindex(1));
-		return StackOps<Decay<R>>::Push(L,
-			func_traits<
+template <typename R, typename ...Args, bool TRUSTED>
+struct call<R (*)(Args...), TRUSTED> {
+	typedef R (*FP)(Args...);
+
+	static int invoke(lua_State *L, FP fp, int classes) {
+		return push_call<Decay<R>, !has_state_arg<Args...>::value>(L, [&]() -> R {
+			return func_traits<
 				R (Args...),
 				index_tuple<sizeof...(Args)>,
-				is_all_pod<Args...>::value
-			>::call(L, fp)
-		);
+				args_mode<TRUSTED, Args...>::value
+			>::call(L, fp);
+		}, classes, 0);
+	}
+
+	static int cfunction(lua_State *L) {
+		return invoke(L, *(FP*)lua_touserdata(L, lua_upvalueindex(1)),
+			lua_upvalueindex(2));
 	}
 };
 
 // ordinary function call wrapper (no return value)
-template <typename ...Args>
-struct call<void (*)(Args...)> {
-	static int cfunction(lua_State *L) {
-		typedef void (*FP)(Args...);
-		auto fp = *(FP*)lua_touserdata(L, lua_upvalueindex(1));
+template <typename ...Args, bool TRUSTED>
+struct call<void (*)(Args...), TRUSTED> {
+	typedef void (*FP)(Args...);
+
+	static int invoke(lua_State *L, FP fp, int) {
 		func_traits<
 			void (Args...),
 			index_tuple<sizeof...(Args)>,
-			is_all_pod<Args...>::value
+			args_mode<TRUSTED, Args...>::value
 		>::call(L, fp);
 		return 0;
 	}
+
+	static int cfunction(lua_State *L) {
+		return invoke(L, *(FP*)lua_touserdata(L, lua_upvalueindex(1)),
+			lua_upvalueindex(2));
+	}
 };
 
 // member function call wrapper
-template <typename T, typename R, typename ...Args>
-struct call<R (T::*)(Args...)> {
-	static int cfunction(lua_State *L) {
-		typedef R (T::*FP)(Args...);
-		T *cls = lj_get_class<T>(L, 1, false);
-		auto fp = *(FP*)lua_touserdata(L, lua_upvalueindex(1));
-		return StackOps<Decay<R>>::Push(L,
-			func_traits<
+template <typename T, typename R, typename ...Args, bool TRUSTED>
+struct call<R (T::*)(Args...), TRUSTED> {
+	typedef R (T::*FP)(Args...);
+
+	static int invoke(lua_State *L, FP fp, int classes) {
+		T *cls = get_self<T, TRUSTED>(L, false);
+		return push_call<Decay<R>, !has_state_arg<Args...>::value>(L, [&]() -> R {
+			return func_traits<
 				R (T::*)(Args...),
 				index_tuple<sizeof...(Args)>,
-				is_all_pod<Args...>::value
-			>::call(L, cls, fp)
-		);
+				args_mode<TRUSTED, Args...>::value
+			>::call(L, cls, fp);
+		}, classes, 0);
+	}
+
+	static int cfunction(lua_State *L) {
+		return invoke(L, *(FP*)lua_touserdata(L, lua_upvalueindex(1)),
+			lua_upvalueindex(2));
 	}
 };
 
 // member function call wrapper (no return value)
-template <typename T, typename ...Args>
-struct call<void (T::*)(Args...)> {
-	static int cfunction(lua_State *L) {
-		typedef void (T::*FP)(Args...);
-		T *cls = lj_get_class<T>(L, 1, false);
-		auto fp = *(FP*)lua_touserdata(L, lua_upvalueindex(1));
+template <typename T, typename ...Args, bool TRUSTED>
+struct call<void (T::*)(Args...), TRUSTED> {
+	typedef void (T::*FP)(Args...);
+
+	static int invoke(lua_State *L, FP fp, int) {
+		T *cls = get_self<T, TRUSTED>(L, false);
 		func_traits<
 			void (T::*)(Args...),
 			index_tuple<sizeof...(Args)>,
-			is_all_pod<Args...>::value
+			args_mode<TRUSTED, Args...>::value
 		>::call(L, cls, fp);
 		return 0;
 	}
+
+	static int cfunction(lua_State *L) {
+		return invoke(L, *(FP*)lua_touserdata(L, lua_upvalueindex(1)),
+			lua_upvalueindex(2));
+	}
 };
 
 // const member function call wrapper
-template <typename T, typename R, typename ...Args>
-struct call<R (T::*)(Args...) const> {
-	static int cfunction(lua_State *L) {
-		typedef R (T::*FP)(Args...) const;
-		const T *cls = lj_get_class<T>(L, 1, true);
-		auto fp = *(FP*)lua_touserdata(L, lua_upvalueindex(1));
-		return StackOps<Decay<R>>::Push(L,
-			func_traits<
+template <typename T, typename R, typename ...Args, bool TRUSTED>
+struct call<R (T::*)(Args...) const, TRUSTED> {
+	typedef R (T::*FP)(Args...) const;
+
+	static int invoke(lua_State *L, FP fp, int classes) {
+		const T *cls = get_self<T, TRUSTED>(L, true);
+		return push_call<Decay<R>, !has_state_arg<Args...>::value>(L, [&]() -> R {
+			return func_traits<
 				R (T::*)(Args...) const,
 				index_tuple<sizeof...(Args)>,
-				is_all_pod<Args...>::value
-			>::call(L, cls, fp)
-		);
+				args_mode<TRUSTED, Args...>::value
+			>::call(L, cls, fp);
+		}, classes, 0);
+	}
+
+	static int cfunction(lua_State *L) {
+		return invoke(L, *(FP*)lua_touserdata(L, lua_upvalueindex(1)),
+			lua_upvalueindex(2));
 	}
 };
 
 // const member function call wrapper (no return value)
-template <typename T, typename ...Args>
-struct call<void (T::*)(Args...) const> {
-	static int cfunction(lua_State *L) {
-		typedef void (T::*FP)(Args...) const;
-		const T *cls = lj_get_class<T>(L, 1, true);
-		auto fp = *(FP*)lua_touserdata(L, lua_upvalueindex(1));
+template <typename T, typename ...Args, bool TRUSTED>
+struct call<void (T::*)(Args...) const, TRUSTED> {
+	typedef void (T::*FP)(Args...) const;
+
+	static int invoke(lua_State *L, FP fp, int) {
+		const T *cls = get_self<T, TRUSTED>(L, true);
 		func_traits<
 			void (T::*)(Args...) const,
 			index_tuple<sizeof...(Args)>,
-			is_all_pod<Args...>::value
+			args_mode<TRUSTED, Args...>::value
 		>::call(L, cls, fp);
 		return 0;
 	}
-};
-
-//============================================================================
-// Constructor binding helper
-//============================================================================
 
-template <typename T, typename ...Args>
-struct construct {
 	static int cfunction(lua_State *L) {
-		void *mem = lua_newuserdata(L, sizeof(UserdataValue<T>));
-		_interlua_rawgetp(L, LUA_REGISTRYINDEX, ClassKey<T>::Class());
-		lua_setmetatable(L, -2);
-		func_traits<
-			T (Args...),
-			index_tuple<sizeof...(Args)>,
-			is_all_pod<Args...>::value
-		>::construct(L, mem);
-		return 1;
+		return invoke(L, *(FP*)lua_touserdata(L, lua_upvalueindex(1)),
+			lua_upvalueindex(2));
 	}
 };
 
 //============================================================================
-// Member lua_CFunction binding helpers (mutable and const)
+// Functor call wrappers
 //============================================================================
 
-template <typename FP>
-struct member_cfunction;
+// Calls a functor (e.g. a lambda with captures) stored in the upvalue 1
+// userdata, the functor is called the same way as an ordinary function.
+template <typename F, bool TRUSTED, typename MFP = decltype(&F::operator())>
+struct functor_call {};
 
-template <typename T>
-struct member_cfunction<int (T::*)(lua_State*)> {
+template <typename F, bool TRUSTED, typename R, typename ...Args>
+struct functor_call<F, TRUSTED, R (F::*)(Args...)> {
 	static int cfunction(lua_State *L) {
-		typedef int (T::*FP)(lua_State*);
-		T *cls = lj_get_class<T>(L, 1, false);
-		auto fp = *(FP*)lua_touserdata(L, lua_upvalueindex(1));
-		return (cls->*fp)(L);
+		F &f = *(F*)lua_touserdata(L, lua_upvalueindex(1));
+		return push_call<Decay<R>, !has_state_arg<Args...>::value>(L, [&]() -> R {
+			return func_traits<
+				R (Args...),
+				index_tuple<sizeof...(Args)>,
+				args_mode<TRUSTED, Args...>::value
+			>::call(L, f);
+		}, lua_upvalueindex(2), 0);
 	}
 };
 
-template <typename T>
-struct member_cfunction<int (T::*)(lua_State*) const> {
+template <typename F, bool TRUSTED, typename ...Args>
+struct functor_call<F, TRUSTED, void (F::*)(Args...)> {
 	static int cfunction(lua_State *L) {
-		typedef int (T::*FP)(lua_State*) const;
-		const T *cls = lj_get_class<T>(L, 1, true);
-		auto fp = *(FP*)lua_touserdata(L, lua_upvalueindex(1));
-		return (cls->*fp)(L);
+		F &f = *(F*)lua_touserdata(L, lua_upvalueindex(1));
+		func_traits<
+			void (Args...),
+			index_tuple<sizeof...(Args)>,
+			args_mode<TRUSTED, Args...>::value
+		>::call(L, f);
+		return 0;
 	}
 };
 
-//============================================================================
-// Variable Access
-//============================================================================
+template <typename F, bool TRUSTED, typename R, typename ...Args>
+struct functor_call<F, TRUSTED, R (F::*)(Args...) const> :
+	functor_call<F, TRUSTED, R (F::*)(Args...)> {};
 
-enum VariableAccess {
-	ReadOnly,
-	ReadWrite,
-};
+template <typename F>
+static int functor_gc(lua_State *L) {
+	static_cast<F*>(lua_touserdata(L, 1))->~F();
+	return 0;
+}
 
-//============================================================================
-// Variable binding helpers
-//============================================================================
+// The registry key of the metatable shared by all functors of type F
+template <typename F>
+struct functor_key {
+	static void *Key() { static int value; return &value; }
+};
 
-template <typename T>
-static int variable_get_set(lua_State *L) {
-	auto p = (T*)lua_touserdata(L, lua_upvalueindex(1));
-	int n = lua_gettop(L);
-	if (n == 0) {
-		return StackOps<Decay<T>>::Push(L, *p);
-	} else {
-		*p = StackOps<Decay<T>>::LJGet(L, 1);
-		return 0;
-	}
+// Pushes a lua_CFunction closure calling 'fp', which is a function pointer, a
+// member function pointer or a functor. The functor is moved into the upvalue
+// userdata, it gets a __gc metamethod only if it needs a destructor call.
+// Upvalue 2 is the class table, see push_class_table.
+template <bool TRUSTED, typename FP>
+static inline void push_function(lua_State *L, FP fp, std::false_type) {
+	*(FP*)lua_newuserdata(L, sizeof(fp)) = fp;
+	push_class_table(L);
+	lua_pushcclosure(L, call<FP, TRUSTED>::cfunction, 2);
 }
 
-template <typename T>
-static int variable_get(lua_State *L) {
-	auto p = (T*)lua_touserdata(L, lua_upvalueindex(1));
-	int n = lua_gettop(L);
-	if (n != 0) {
-		luaL_error(L, "'%s' is read-only", lua_tostring(L, lua_upvalueindex(2)));
+template <bool TRUSTED, typename F>
+static inline void push_function(lua_State *L, F f, std::true_type) {
+	new (lua_newuserdata(L, sizeof(F))) F(std::move(f));
+	if (!std::is_trivially_destructible<F>::value) {
+		_interlua_rawgetp(L, LUA_REGISTRYINDEX, functor_key<F>::Key());
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			lua_newtable(L);
+			lua_pushcfunction(L, functor_gc<F>);
+			rawsetfield(L, -2, "__gc");
+			lua_pushvalue(L, -1);
+			_interlua_rawsetp(L, LUA_REGISTRYINDEX, functor_key<F>::Key());
+		}
+		lua_setmetatable(L, -2);
 	}
-	return StackOps<Decay<T>>::Push(L, *p);
+	push_class_table(L);
+	lua_pushcclosure(L, functor_call<F, TRUSTED>::cfunction, 2);
 }
 
-template <typename TG, typename TS>
-static int variable_getter_setter(lua_State *L) {
-	using get_t = TG (*)();
-	using set_t = void (*)(TS);
+template <bool TRUSTED, typename FP>
+static inline void push_function(lua_State *L, FP fp) {
+	push_function<TRUSTED>(L, std::move(fp), std::is_class<FP>());
+}
+
+//============================================================================
+// Compile-time bound function call wrappers
+//============================================================================
+
+// Same as call<FP>, but the function pointer is a template argument. The
+// resulting lua_CFunction needs only the class table as upvalue 1 (see
+// push_direct_call) and the compiler is free to inline the call.
+template <typename FP, FP fp, bool TRUSTED = false>
+struct direct_call {};
+
+// ordinary function call wrapper
+template <typename R, typename ...Args, R (*fp)(Args...), bool TRUSTED>
+struct direct_call<R (*)(Args...), fp, TRUSTED> {
+	static int cfunction(lua_State *L) {
+		return push_call<Decay<R>, !has_state_arg<Args...>::value>(L, [&]() -> R {
+			return func_traits<
+				R (Args...),
+				index_tuple<sizeof...(Args)>,
+				args_mode<TRUSTED, Args...>::value
+			>::call(L, fp);
+		}, lua_upvalueindex(1), 0);
+	}
+};
+
+// ordinary function call wrapper (no return value)
+template <typename ...Args, void (*fp)(Args...), bool TRUSTED>
+struct direct_call<void (*)(Args...), fp, TRUSTED> {
+	static int cfunction(lua_State *L) {
+		func_traits<
+			void (Args...),
+			index_tuple<sizeof...(Args)>,
+			args_mode<TRUSTED, Args...>::value
+		>::call(L, fp);
+		return 0;
+	}
+};
+
+// member function call wrapper
+template <typename T, typename R, typename ...Args, R (T::*fp)(Args...), bool TRUSTED>
+struct direct_call<R (T::*)(Args...), fp, TRUSTED> {
+	static int cfunction(lua_State *L) {
+		T *cls = get_self<T, TRUSTED>(L, false);
+		return push_call<Decay<R>, !has_state_arg<Args...>::value>(L, [&]() -> R {
+			return func_traits<
+				R (T::*)(Args...),
+				index_tuple<sizeof...(Args)>,
+				args_mode<TRUSTED, Args...>::value
+			>::call(L, cls, fp);
+		}, lua_upvalueindex(1), 0);
+	}
+};
+
+// member function call wrapper (no return value)
+template <typename T, typename ...Args, void (T::*fp)(Args...), bool TRUSTED>
+struct direct_call<void (T::*)(Args...), fp, TRUSTED> {
+	static int cfunction(lua_State *L) {
+		T *cls = get_self<T, TRUSTED>(L, false);
+		func_traits<
+			void (T::*)(Args...),
+			index_tuple<sizeof...(Args)>,
+			args_mode<TRUSTED, Args...>::value
+		>::call(L, cls, fp);
+		return 0;
+	}
+};
+
+// const member function call wrapper
+template <typename T, typename R, typename ...Args, R (T::*fp)(Args...) const, bool TRUSTED>
+struct direct_call<R (T::*)(Args...) const, fp, TRUSTED> {
+	static int cfunction(lua_State *L) {
+		const T *cls = get_self<T, TRUSTED>(L, true);
+		return push_call<Decay<R>, !has_state_arg<Args...>::value>(L, [&]() -> R {
+			return func_traits<
+				R (T::*)(Args...) const,
+				index_tuple<sizeof...(Args)>,
+				args_mode<TRUSTED, Args...>::value
+			>::call(L, cls, fp);
+		}, lua_upvalueindex(1), 0);
+	}
+};
+
+// const member function call wrapper (no return value)
+template <typename T, typename ...Args, void (T::*fp)(Args...) const, bool TRUSTED>
+struct direct_call<void (T::*)(Args...) const, fp, TRUSTED> {
+	static int cfunction(lua_State *L) {
+		const T *cls = get_self<T, TRUSTED>(L, true);
+		func_traits<
+			void (T::*)(Args...) const,
+			index_tuple<sizeof...(Args)>,
+			args_mode<TRUSTED, Args...>::value
+		>::call(L, cls, fp);
+		return 0;
+	}
+};
+
+// pushes direct_call<FP, fp, TRUSTED>::cfunction with its upvalue
+template <typename FP, FP fp, bool TRUSTED>
+static inline void push_direct_call(lua_State *L) {
+	push_class_table(L);
+	lua_pushcclosure(L, direct_call<FP, fp, TRUSTED>::cfunction, 1);
+}
+
+// C++11 has no "auto" template parameters, this macro expands to both
+// template arguments of the compile-time bound Function/StaticFunction:
+//   Class<Foo>("Foo").Function<INTERLUA_FP(&Foo::bar)>("bar")
+#define INTERLUA_FP(fp) std::decay<decltype(fp)>::type, fp
+
+//============================================================================
+// Overload set helpers
+//============================================================================
+
+// arg_matches<T>::test is a cheap check of whether the value at 'index' can be
+// passed as T (Decay'ed), it's used to pick a function from an overload set.
+// Only the lua type is examined, class values go through the fast header
+// check. Types with custom StackOps may specialize it.
+template <typename T, typename Enable = void>
+struct arg_matches {
+	using PURE_T = typename std::decay<T>::type;
+	using NOREF_T = typename std::remove_reference<T>::type;
+	static inline bool test(lua_State *L, int index) {
+		return try_get_userdata(L, index,
+			ClassKey<PURE_T>::Class(), ClassKey<PURE_T>::Const(),
+			std::is_const<NOREF_T>::value) != nullptr;
+	}
+};
+
+template <typename T>
+struct arg_matches<T*> {
+	using PURE_T = typename std::decay<T>::type;
+	static inline bool test(lua_State *L, int index) {
+		return lua_isnil(L, index) || try_get_userdata(L, index,
+			ClassKey<PURE_T>::Class(), ClassKey<PURE_T>::Const(),
+			std::is_const<T>::value) != nullptr;
+	}
+};
+
+template <typename T>
+struct arg_matches<T, typename std::enable_if<std::is_arithmetic<T>::value>::type> {
+	static inline bool test(lua_State *L, int index) {
+#if LUA_VERSION_NUM >= 503
+		// numbers have an integer subtype, 1 and 1.0 match integers,
+		// 1.5 matches floating point types only
+		if (std::is_integral<T>::value) {
+			int isnum = 0;
+			if (lua_type(L, index) == LUA_TNUMBER)
+				lua_tointegerx(L, index, &isnum);
+			return isnum != 0;
+		}
+#endif
+		return lua_type(L, index) == LUA_TNUMBER;
+	}
+};
+
+template <>
+struct arg_matches<bool> {
+	static inline bool test(lua_State*, int) { return true; }
+};
+
+template <>
+struct arg_matches<char> {
+	static inline bool test(lua_State *L, int index) {
+		return lua_type(L, index) == LUA_TSTRING;
+	}
+};
+
+template <>
+struct arg_matches<const char*> {
+	static inline bool test(lua_State *L, int index) {
+		return lua_type(L, index) == LUA_TSTRING || lua_isnil(L, index);
+	}
+};
+
+template <>
+struct arg_matches<StringView> {
+	static inline bool test(lua_State *L, int index) {
+		return lua_type(L, index) == LUA_TSTRING;
+	}
+};
+
+template <> struct arg_matches<const StringView&> : arg_matches<StringView> {};
+template <> struct arg_matches<StringView&&> : arg_matches<StringView> {};
+
+template <>
+struct arg_matches<lua_State*> {
+	static inline bool test(lua_State*, int) { return true; }
+};
+
+template <int I, typename ...Args>
+struct args_match {
+	static inline bool test(lua_State*) { return true; }
+};
+
+template <int I, typename T, typename ...Args>
+struct args_match<I, T, Args...> {
+	static inline bool test(lua_State *L) {
+		return arg_matches<Decay<T>>::test(L, I) &&
+			args_match<I+1, Args...>::test(L);
+	}
+};
+
+template <typename FP>
+struct overload_matches;
+
+template <typename R, typename ...Args>
+struct overload_matches<R (*)(Args...)> {
+	static inline bool test(lua_State *L) {
+		return lua_gettop(L) == sizeof...(Args) &&
+			args_match<1, Args...>::test(L);
+	}
+};
+
+template <typename T, typename R, typename ...Args>
+struct overload_matches<R (T::*)(Args...)> {
+	static inline bool test(lua_State *L) {
+		return lua_gettop(L) == sizeof...(Args) + 1 &&
+			arg_matches<T&>::test(L, 1) &&
+			args_match<2, Args...>::test(L);
+	}
+};
+
+template <typename T, typename R, typename ...Args>
+struct overload_matches<R (T::*)(Args...) const> {
+	static inline bool test(lua_State *L) {
+		return lua_gettop(L) == sizeof...(Args) + 1 &&
+			arg_matches<const T&>::test(L, 1) &&
+			args_match<2, Args...>::test(L);
+	}
+};
+
+// A single lua_CFunction for a set of functions registered under one name,
+// upvalue 1 is a userdata with a tuple of the function pointers, upvalue 2 is
+// the class table (see push_class_table). The first
+// function (in the registration order) that matches the number of arguments
+// and their types is called.
+template <bool TRUSTED, typename ...FPs>
+struct overload_set {
+	using fps_t = std::tuple<FPs...>;
+	static constexpr int N = sizeof...(FPs);
+
+	template <int I>
+	static inline int dispatch(lua_State *L, const fps_t &fps, std::integral_constant<int, I>) {
+		using FP = typename std::tuple_element<I, fps_t>::type;
+		if (overload_matches<FP>::test(L))
+			return call<FP, TRUSTED>::invoke(L, std::get<I>(fps),
+				lua_upvalueindex(2));
+		return dispatch(L, fps, std::integral_constant<int, I+1>());
+	}
+
+	static inline int dispatch(lua_State *L, const fps_t&, std::integral_constant<int, N>) {
+		return luaL_error(L, "no overload matches the arguments (%d given)",
+			lua_gettop(L));
+	}
+
+	static int cfunction(lua_State *L) {
+		auto fps = (const fps_t*)lua_touserdata(L, lua_upvalueindex(1));
+		return dispatch(L, *fps, std::integral_constant<int, 0>());
+	}
+
+	static void push(lua_State *L, FPs ...fps) {
+		new (lua_newuserdata(L, sizeof(fps_t))) fps_t(fps...);
+		push_class_table(L);
+		lua_pushcclosure(L, cfunction, 2);
+	}
+};
+
+//============================================================================
+// Constructor binding helper
+//============================================================================
+
+// upvalue 1 is the class metatable, upvalue 2 is its class_info, this way
+// constructing an object doesn't look anything up in the registry
+template <typename T, bool TRUSTED, typename ...Args>
+struct construct {
+	static int cfunction(lua_State *L) {
+		// the metatable (and hence __gc) is set after the object is
+		// constructed, getting the arguments may raise a lua error
+		void *mem = lua_newuserdata(L, sizeof(UserdataValue<T>));
+		auto ud = func_traits<
+			T (Args...),
+			index_tuple<sizeof...(Args)>,
+			args_mode<TRUSTED, Args...>::value
+		>::construct(L, mem);
+		ud->info = (class_info*)lua_touserdata(L, lua_upvalueindex(2));
+		lua_pushvalue(L, lua_upvalueindex(1));
+		lua_setmetatable(L, -2);
+		return 1;
+	}
+};
+
+//============================================================================
+// Member lua_CFunction binding helpers (mutable and const)
+//============================================================================
+
+template <typename FP>
+struct member_cfunction;
+
+template <typename T>
+struct member_cfunction<int (T::*)(lua_State*)> {
+	static int cfunction(lua_State *L) {
+		typedef int (T::*FP)(lua_State*);
+		T *cls = lj_get_class<T>(L, 1, false);
+		auto fp = *(FP*)lua_touserdata(L, lua_upvalueindex(1));
+		return (cls->*fp)(L);
+	}
+};
+
+template <typename T>
+struct member_cfunction<int (T::*)(lua_State*) const> {
+	static int cfunction(lua_State *L) {
+		typedef int (T::*FP)(lua_State*) const;
+		const T *cls = lj_get_class<T>(L, 1, true);
+		auto fp = *(FP*)lua_touserdata(L, lua_upvalueindex(1));
+		return (cls->*fp)(L);
+	}
+};
+
+//============================================================================
+// Variable Access
+//============================================================================
+
+enum VariableAccess {
+	ReadOnly,
+	ReadWrite,
+};
+
+//============================================================================
+// Variable binding helpers
+//============================================================================
+
+template <typename T>
+static int variable_get_set(lua_State *L) {
+	auto p = (T*)lua_touserdata(L, lua_upvalueindex(1));
+	int n = lua_gettop(L);
+	if (n == 0) {
+		return StackOps<Decay<T>>::Push(L, *p);
+	} else {
+		*p = StackOps<Decay<T>>::LJGet(L, 1);
+		return 0;
+	}
+}
+
+template <typename T>
+static int variable_get(lua_State *L) {
+	auto p = (T*)lua_touserdata(L, lua_upvalueindex(1));
+	int n = lua_gettop(L);
+	if (n != 0) {
+		luaL_error(L, "'%s' is read-only", lua_tostring(L, lua_upvalueindex(2)));
+	}
+	return StackOps<Decay<T>>::Push(L, *p);
+}
+
+template <typename TG, typename TS>
+static int variable_getter_setter(lua_State *L) {
+	using get_t = TG (*)();
+	using set_t = void (*)(TS);
 
 	auto get = *(get_t*)lua_touserdata(L, lua_upvalueindex(1));
 	auto set = *(set_t*)lua_touserdata(L, lua_upvalueindex(2));
@@ -888,106 +1672,223 @@ template <typename G> struct get_property;
 template <typename U, typename T>
 struct get_property<U T::*> {
 	using G = U T::*;
-	static inline int cfunction(lua_State *L) {
-		auto mp = *(G*)lua_touserdata(L, lua_upvalueindex(1));
+	static inline int get(lua_State *L, G mp) {
 		T *cls = lj_get_class<T>(L, 1, true);
 		return StackOps<Decay<const U&>>::Push(L, cls->*mp);
 	}
+	static inline int cfunction(lua_State *L) {
+		return get(L, *(G*)lua_touserdata(L, lua_upvalueindex(1)));
+	}
 };
 
 template <typename U, typename T>
 struct get_property<U (*)(const T&)> {
 	using G = U (*)(const T&);
-	static inline int cfunction(lua_State *L) {
-		auto mp = *(G*)lua_touserdata(L, lua_upvalueindex(1));
+	static inline int get(lua_State *L, G mp) {
 		const T *cls = lj_get_class<T>(L, 1, true);
-		return StackOps<Decay<const U&>>::Push(L, (*mp)(*cls));
+		return push_call<Decay<const U&>>(L, [&]() -> U { return (*mp)(*cls); }, 0, 0);
+	}
+	static inline int cfunction(lua_State *L) {
+		return get(L, *(G*)lua_touserdata(L, lua_upvalueindex(1)));
 	}
 };
 
 template <typename U, typename T>
 struct get_property<U (*)(const T*)> {
 	using G = U (*)(const T*);
-	static inline int cfunction(lua_State *L) {
-		auto mp = *(G*)lua_touserdata(L, lua_upvalueindex(1));
+	static inline int get(lua_State *L, G mp) {
 		const T *cls = lj_get_class<T>(L, 1, true);
-		return StackOps<Decay<const U&>>::Push(L, (*mp)(cls));
+		return push_call<Decay<const U&>>(L, [&]() -> U { return (*mp)(cls); }, 0, 0);
+	}
+	static inline int cfunction(lua_State *L) {
+		return get(L, *(G*)lua_touserdata(L, lua_upvalueindex(1)));
 	}
 };
 
 template <typename U, typename T>
 struct get_property<U (T::*)() const> {
 	using G = U (T::*)() const;
-	static inline int cfunction(lua_State *L) {
-		auto mp = *(G*)lua_touserdata(L, lua_upvalueindex(1));
+	static inline int get(lua_State *L, G mp) {
 		const T *cls = lj_get_class<T>(L, 1, true);
-		return StackOps<Decay<const U&>>::Push(L, (cls->*mp)());
+		return push_call<Decay<const U&>>(L, [&]() -> U { return (cls->*mp)(); }, 0, 0);
+	}
+	static inline int cfunction(lua_State *L) {
+		return get(L, *(G*)lua_touserdata(L, lua_upvalueindex(1)));
 	}
 };
 
 //----------------------------------------------------------------------------
 
+// 'value' is the stack index of the new value, 'self' is always at 1
 template <typename G> struct set_property;
 
 template <typename U, typename T>
 struct set_property<U T::*> {
 	using G = U T::*;
-	static inline int cfunction(lua_State *L) {
-		auto mp = *(G*)lua_touserdata(L, lua_upvalueindex(1));
+	static inline int set(lua_State *L, G mp, int value) {
 		T *cls = lj_get_class<T>(L, 1, false);
-		cls->*mp = StackOps<Decay<U>>::LJGet(L, 2);
+		cls->*mp = StackOps<Decay<U>>::LJGet(L, value);
 		return 0;
 	}
+	static inline int cfunction(lua_State *L) {
+		return set(L, *(G*)lua_touserdata(L, lua_upvalueindex(1)), 2);
+	}
 };
 
 template <typename U, typename T>
 struct set_property<void (*)(T&, U)> {
 	using G = void (*)(T&, U);
-	static inline int cfunction(lua_State *L) {
-		auto mp = *(G*)lua_touserdata(L, lua_upvalueindex(2));
+	static inline int set(lua_State *L, G mp, int value) {
 		T *cls = lj_get_class<T>(L, 1, false);
-		(*mp)(*cls, StackOps<Decay<U>>::LJGet(L, 2));
+		(*mp)(*cls, StackOps<Decay<U>>::LJGet(L, value));
 		return 0;
 	}
+	static inline int cfunction(lua_State *L) {
+		return set(L, *(G*)lua_touserdata(L, lua_upvalueindex(2)), 2);
+	}
 };
 
 template <typename U, typename T>
 struct set_property<void (*)(T*, U)> {
 	using G = void (*)(T*, U);
-	static inline int cfunction(lua_State *L) {
-		auto mp = *(G*)lua_touserdata(L, lua_upvalueindex(2));
+	static inline int set(lua_State *L, G mp, int value) {
 		T *cls = lj_get_class<T>(L, 1, false);
-		(*mp)(cls, StackOps<Decay<U>>::LJGet(L, 2));
+		(*mp)(cls, StackOps<Decay<U>>::LJGet(L, value));
 		return 0;
 	}
+	static inline int cfunction(lua_State *L) {
+		return set(L, *(G*)lua_touserdata(L, lua_upvalueindex(2)), 2);
+	}
 };
 
 template <typename U, typename T>
 struct set_property<void (T::*)(U)> {
 	using G = void (T::*)(U);
-	static inline int cfunction(lua_State *L) {
-		auto mp = *(G*)lua_touserdata(L, lua_upvalueindex(2));
+	static inline int set(lua_State *L, G mp, int value) {
 		T *cls = lj_get_class<T>(L, 1, false);
-		(cls->*mp)(StackOps<Decay<U>>::LJGet(L, 2));
+		(cls->*mp)(StackOps<Decay<U>>::LJGet(L, value));
 		return 0;
 	}
+	static inline int cfunction(lua_State *L) {
+		return set(L, *(G*)lua_touserdata(L, lua_upvalueindex(2)), 2);
+	}
 };
 
+//============================================================================
+// Field binding helpers
+//============================================================================
+
+// Classes with field syntax enabled (see CWrapper::Fields) keep accessors in
+// the "__get" and "__set" tables of their metatables. The __index and
+// __newindex dispatchers look the key up there and call the accessor
+// directly, without going through lua_call.
+struct field_accessor {
+	int (*call)(lua_State *L, const field_accessor *fa);
+};
+
+template <typename G>
+struct field_getter : field_accessor {
+	G get;
+
+	static int cfunction(lua_State *L, const field_accessor *fa) {
+		auto fg = static_cast<const field_getter*>(fa);
+		return get_property<G>::get(L, fg->get);
+	}
+
+	field_getter(G get): field_accessor{cfunction}, get(get) {}
+};
+
+// __newindex receives (self, key, value), hence the value is at 3
+template <typename S>
+struct field_setter : field_accessor {
+	S set;
+
+	static int cfunction(lua_State *L, const field_accessor *fa) {
+		auto fs = static_cast<const field_setter*>(fa);
+		return set_property<S>::set(L, fs->set, 3);
+	}
+
+	field_setter(S set): field_accessor{cfunction}, set(set) {}
+};
+
+// Switches the class and const metatables at -2 and -3 to field syntax. It's
+// a no-op if the class has it enabled already.
+void enable_fields(lua_State *L, int interned);
+
+// adds weak-valued pointer caches to the class and const metatables at -2 and
+// -3, see CWrapper::CachePointers
+void enable_pointer_cache(lua_State *L, int interned);
+
 //============================================================================
 // Class
 //============================================================================
 
 class NSWrapper;
 
-template <typename T>
+// INTERLUA_TRUSTED makes all bindings trusted, see CWrapper::Trusted
+#ifdef INTERLUA_TRUSTED
+constexpr bool trusted_by_default = true;
+#else
+constexpr bool trusted_by_default = false;
+#endif
+
+template <typename T, bool TRUSTED = trusted_by_default>
 class CWrapper {
 	lua_State *L = nullptr;
 	NSWrapper &parent;
+	int interned; // see push_interned
+
+	bool has_fields() {
+		rawgetkey(L, -2, interned, KeyGet);
+		bool fields = !lua_isnil(L, -1);
+		lua_pop(L, 1);
+		return fields;
+	}
+
+	template <typename G, typename S>
+	void field(const char *name, G get, S set) {
+		rawgetkey(L, -3, interned, KeyGet);
+		rawgetkey(L, -3, interned, KeyGet);
+		new (lua_newuserdata(L, sizeof(field_getter<G>))) field_getter<G>(get);
+		lua_pushvalue(L, -1);
+		rawsetfield(L, -3, name);
+		rawsetfield(L, -3, name);
+		lua_pop(L, 2);
+		if (set == nullptr)
+			return;
+
+		rawgetkey(L, -2, interned, KeySet);
+		new (lua_newuserdata(L, sizeof(field_setter<S>))) field_setter<S>(set);
+		rawsetfield(L, -2, name);
+		lua_pop(L, 1);
+	}
+
+	// registers the function on top of the stack as the metamethod 'name'
+	// of the class (and the const class, if 'on_const' is true), pops it
+	void metamethod(const char *name, bool on_const) {
+		// "__index", "__gc" and friends belong to interlua, replacing them
+		// would break the class and all of its derived classes
+		if (!is_operator_name(name))
+			die("'%s' can't be bound as a class operator", name);
+		rawgetkey(L, -4, interned, KeyOperators);
+		rawgetkey(L, -4, interned, KeyOperators);
+		if (on_const) {
+			lua_pushvalue(L, -3);
+			rawsetfield(L, -3, name);
+		}
+		lua_pushvalue(L, -3);
+		rawsetfield(L, -2, name);
+		lua_pop(L, 3);
+	}
 
 	template <typename G, typename S>
 	void property(const char *name, G get, S set) {
-		rawgetfield(L, -3, "__index");
-		rawgetfield(L, -3, "__index");
+		if (has_fields()) {
+			field(name, get, set);
+			return;
+		}
+		rawgetkey(L, -3, interned, KeyMethods);
+		rawgetkey(L, -3, interned, KeyMethods);
 		*(G*)lua_newuserdata(L, sizeof(G)) = get;
 		if (set == nullptr) {
 			lua_pushstring(L, name);
@@ -1009,13 +1910,35 @@ class CWrapper {
 
 public:
 	CWrapper() = delete;
-	CWrapper(lua_State *L, NSWrapper &parent): L(L), parent(parent) {}
-	inline NSWrapper &End() { lua_pop(L, 3); return parent; }
+	CWrapper(lua_State *L, NSWrapper &parent, int interned):
+		L(L), parent(parent), interned(interned) {}
+	inline NSWrapper &End() { flatten_class(L, interned); lua_pop(L, 3); return parent; }
+
+	// Functions, static functions and constructors registered after this
+	// call skip validation of 'self' and arguments: arguments are taken
+	// from the lua stack as is. Use it for bindings called only by
+	// trusted and tested scripts, passing a wrong value to a trusted
+	// binding is undefined behaviour.
+	inline CWrapper<T, true> Trusted() { return {L, parent, interned}; }
+
+	// Variables and properties registered after this call are accessed with
+	// the field syntax: 'obj.x' and 'obj.x = v' instead of 'obj:x()' and
+	// 'obj:x(v)'. Other keys are looked up in the method table. Derived
+	// classes registered afterwards inherit the field syntax.
+	inline CWrapper &Fields() { enable_fields(L, interned); return *this; }
+
+	// Pointers to objects of the class pushed to lua are kept in a weak
+	// table, pushing the same pointer again gives the same userdata
+	// (as long as it's alive) instead of creating a new one. Derived
+	// classes registered afterwards inherit the cache. See also Evict.
+	inline CWrapper &CachePointers() { enable_pointer_cache(L, interned); return *this; }
 
 	template <typename ...Args>
 	CWrapper &Constructor() {
-		lua_pushcclosure(L, construct<T, Args...>::cfunction, 0);
-		rawsetfield(L, -2, "__call");
+		lua_pushvalue(L, -2);
+		lua_rawgeti(L, -1, 1);
+		lua_pushcclosure(L, construct<T, TRUSTED, Args...>::cfunction, 2);
+		rawsetkey(L, -2, interned, KeyCall);
 		return *this;
 	}
 
@@ -1043,8 +1966,12 @@ public:
 	template <typename U>
 	CWrapper &Variable(const char *name, U T:: *mp, VariableAccess va = ReadWrite) {
 		using mp_t = U T::*;
-		rawgetfield(L, -3, "__index");
-		rawgetfield(L, -3, "__index");
+		if (has_fields()) {
+			field(name, mp, va == ReadOnly ? nullptr : mp);
+			return *this;
+		}
+		rawgetkey(L, -3, interned, KeyMethods);
+		rawgetkey(L, -3, interned, KeyMethods);
 		*(mp_t*)lua_newuserdata(L, sizeof(mp_t)) = mp;
 		if (va == ReadOnly) {
 			lua_pushstring(L, name);
@@ -1064,14 +1991,16 @@ public:
 		return *this;
 	}
 
+	// 'fp' is a member function pointer, a function pointer or a functor
+	// (e.g. a lambda with captures), the latter two get 'self' as the first
+	// argument
 	template <typename FP>
 	CWrapper &Function(const char *name, FP fp) {
 		// TODO: check if FP belongs to this class
-		rawgetfield(L, -3, "__index");
-		rawgetfield(L, -3, "__index");
-		*(FP*)lua_newuserdata(L, sizeof(fp)) = fp;
-		lua_pushcclosure(L, call<FP>::cfunction, 1);
-		if (is_const_member_function<FP>::value) {
+		rawgetkey(L, -3, interned, KeyMethods);
+		rawgetkey(L, -3, interned, KeyMethods);
+		push_function<TRUSTED>(L, std::move(fp));
+		if (is_const_callable<FP>::value) {
 			lua_pushvalue(L, -1);
 			rawsetfield(L, -3, name);
 			rawsetfield(L, -3, name);
@@ -1083,10 +2012,72 @@ public:
 		return *this;
 	}
 
+	// Registers an overload set under one name: the function to call is
+	// picked by the number of arguments and their lua types, the first
+	// matching one in the given order wins (see arg_matches).
+	template <typename FP1, typename FP2, typename ...FPs>
+	CWrapper &Function(const char *name, FP1 fp1, FP2 fp2, FPs ...fps) {
+		const bool on_const[] = {
+			is_const_callable<FP1>::value,
+			is_const_callable<FP2>::value,
+			is_const_callable<FPs>::value...,
+		};
+		rawgetkey(L, -3, interned, KeyMethods);
+		rawgetkey(L, -3, interned, KeyMethods);
+		overload_set<TRUSTED, FP1, FP2, FPs...>::push(L, fp1, fp2, fps...);
+		for (bool c : on_const) {
+			if (c) {
+				lua_pushvalue(L, -1);
+				rawsetfield(L, -4, name);
+				break;
+			}
+		}
+		rawsetfield(L, -2, name);
+		lua_pop(L, 2);
+		return *this;
+	}
+
+	// compile-time bound version of the method above, use INTERLUA_FP
+	template <typename FP, FP fp>
+	CWrapper &Function(const char *name) {
+		rawgetkey(L, -3, interned, KeyMethods);
+		rawgetkey(L, -3, interned, KeyMethods);
+		push_direct_call<FP, fp, TRUSTED>(L);
+		if (is_const_member_function<FP>::value) {
+			lua_pushvalue(L, -1);
+			rawsetfield(L, -3, name);
+			rawsetfield(L, -3, name);
+		} else {
+			rawsetfield(L, -2, name);
+		}
+		lua_pop(L, 2);
+		return *this;
+	}
+
+	// Binds a function as the metamethod 'name' of the class, e.g.
+	// Operator("__add", &Vec::operator+). Only the arithmetic, bitwise and
+	// comparison metamethods, "__len", "__concat", "__call" and "__tostring"
+	// are accepted, other names die. Member functions get the left operand as 'self', free
+	// functions get the operands as is. Derived classes inherit operators.
+	template <typename FP>
+	CWrapper &Operator(const char *name, FP fp) {
+		push_function<TRUSTED>(L, std::move(fp));
+		metamethod(name, is_const_callable<FP>::value);
+		return *this;
+	}
+
+	// compile-time bound version of the method above, use INTERLUA_FP
+	template <typename FP, FP fp>
+	CWrapper &Operator(const char *name) {
+		push_direct_call<FP, fp, TRUSTED>(L);
+		metamethod(name, is_const_callable<FP>::value);
+		return *this;
+	}
+
 	CWrapper &CFunction(const char *name, int (T::*fp)(lua_State*) const) {
 		using FP = int (T::*)(lua_State*) const;
-		rawgetfield(L, -3, "__index");
-		rawgetfield(L, -3, "__index");
+		rawgetkey(L, -3, interned, KeyMethods);
+		rawgetkey(L, -3, interned, KeyMethods);
 		*(FP*)lua_newuserdata(L, sizeof(fp)) = fp;
 		lua_pushcclosure(L, member_cfunction<FP>::cfunction, 1);
 		lua_pushvalue(L, -1);
@@ -1099,7 +2090,7 @@ public:
 	CWrapper &CFunction(const char *name, int (T::*fp)(lua_State*)) {
 		// TODO: add const stub function
 		using FP = int (T::*)(lua_State*);
-		rawgetfield(L, -2, "__index");
+		rawgetkey(L, -2, interned, KeyMethods);
 		*(FP*)lua_newuserdata(L, sizeof(fp)) = fp;
 		lua_pushcclosure(L, member_cfunction<FP>::cfunction, 1);
 		rawsetfield(L, -2, name);
@@ -1130,8 +2121,23 @@ public:
 
 	template <typename FP>
 	CWrapper &StaticFunction(const char *name, FP fp) {
-		*(FP*)lua_newuserdata(L, sizeof(fp)) = fp;
-		lua_pushcclosure(L, call<FP>::cfunction, 1);
+		push_function<TRUSTED>(L, std::move(fp));
+		rawsetfield(L, -2, name);
+		return *this;
+	}
+
+	// overload set version of the method above, see Function
+	template <typename FP1, typename FP2, typename ...FPs>
+	CWrapper &StaticFunction(const char *name, FP1 fp1, FP2 fp2, FPs ...fps) {
+		overload_set<TRUSTED, FP1, FP2, FPs...>::push(L, fp1, fp2, fps...);
+		rawsetfield(L, -2, name);
+		return *this;
+	}
+
+	// compile-time bound version of the method above, use INTERLUA_FP
+	template <typename FP, FP fp>
+	CWrapper &StaticFunction(const char *name) {
+		push_direct_call<FP, fp, TRUSTED>(L);
 		rawsetfield(L, -2, name);
 		return *this;
 	}
@@ -1151,19 +2157,36 @@ public:
 class NSWrapper {
 	lua_State *L = nullptr;
 
+	// the table of pre-interned keys (see push_interned) stays on the stack
+	// right below the outermost namespace table until its End()
+	int interned;
+
+	NSWrapper(lua_State *L, int interned): L(L), interned(interned) {}
+
 public:
 	NSWrapper() = delete;
-	NSWrapper(lua_State *L): L(L) {}
+
+	// expects the namespace table on top of the stack
+	NSWrapper(lua_State *L): L(L) {
+		push_interned(L);
+		lua_insert(L, -2);
+		interned = lua_gettop(L) - 1;
+	}
 
 	NSWrapper Namespace(const char *name);
-	inline NSWrapper End() { lua_pop(L, 1); return {L}; }
+	inline NSWrapper End() {
+		lua_pop(L, 1);
+		if (lua_gettop(L) == interned)
+			lua_pop(L, 1);
+		return {L, interned};
+	}
 
 	template <typename T>
 	CWrapper<T> Class(const char *name, parent_class_keys *parent = nullptr) {
 		rawgetfield(L, -1, name);
 		if (!lua_isnil(L, -1)) {
-			rawgetfield(L, -1, "__class");
-			rawgetfield(L, -1, "__const");
+			rawgetkey(L, -1, interned, KeyClass);
+			rawgetkey(L, -1, interned, KeyConst);
 
 			// arrange tables in proper order:
 			// -1 static table
@@ -1171,7 +2194,7 @@ public:
 			// -3 const table
 			lua_insert(L, -3);
 			lua_insert(L, -2);
-			return {L, *this};
+			return {L, *this, interned};
 		}
 
 		lua_pop(L, 1); // pop nil
@@ -1179,15 +2202,17 @@ public:
 			ClassKey<T>::Static(),
 			ClassKey<T>::Class(),
 			ClassKey<T>::Const(),
+			ClassKey<T>::ClassId(),
+			ClassKey<T>::ConstId(),
 			parent,
 		};
-		register_class_tables(L, name, keys);
+		register_class_tables(L, name, keys, interned);
 
 		// namespace[name] = static_table
 		lua_pushvalue(L, -1);
 		rawsetfield(L, -5, name);
 
-		return {L, *this};
+		return {L, *this, interned};
 	}
 
 	template <typename T, typename Base>
@@ -1218,10 +2243,26 @@ public:
 		return *this;
 	}
 
+	// 'fp' is a function pointer or a functor (e.g. a lambda with captures)
 	template <typename FP>
 	NSWrapper &Function(const char *name, FP fp) {
-		*(FP*)lua_newuserdata(L, sizeof(fp)) = fp;
-		lua_pushcclosure(L, call<FP>::cfunction, 1);
+		push_function<trusted_by_default>(L, std::move(fp));
+		rawsetfield(L, -2, name);
+		return *this;
+	}
+
+	// overload set version of the method above, see CWrapper::Function
+	template <typename FP1, typename FP2, typename ...FPs>
+	NSWrapper &Function(const char *name, FP1 fp1, FP2 fp2, FPs ...fps) {
+		overload_set<trusted_by_default, FP1, FP2, FPs...>::push(L, fp1, fp2, fps...);
+		rawsetfield(L, -2, name);
+		return *this;
+	}
+
+	// compile-time bound version of the method above, use INTERLUA_FP
+	template <typename FP, FP fp>
+	NSWrapper &Function(const char *name) {
+		push_direct_call<FP, fp, trusted_by_default>(L);
 		rawsetfield(L, -2, name);
 		return *this;
 	}
@@ -1309,10 +2350,95 @@ static inline int recursive_push(lua_State *L, T &&arg) {
 	return StackOps<Decay<T>>::Push(L, std::forward<T>(arg));
 }
 
-template <typename T, typename ...Args>
-static inline int recursive_push(lua_State *L, T &&arg, Args &&...args) {
-	const int n = StackOps<Decay<T>>::Push(L, std::forward<T>(arg));
-	return n + recursive_push(L, std::forward<Args>(args)...);
+template <typename T, typename ...Args>
+static inline int recursive_push(lua_State *L, T &&arg, Args &&...args) {
+	const int n = StackOps<Decay<T>>::Push(L, std::forward<T>(arg));
+	return n + recursive_push(L, std::forward<Args>(args)...);
+}
+
+// pushes exactly one value, the way lua adjusts an expression to a single
+// value: extra values are dropped, no value becomes nil
+template <typename T>
+static inline void push_one(lua_State *L, T &&v) {
+	const int n = StackOps<Decay<T>>::Push(L, std::forward<T>(v));
+	if (n == 0)
+		lua_pushnil(L);
+	else if (n > 1)
+		lua_pop(L, n - 1);
+}
+
+//============================================================================
+// Recursive get helper
+//============================================================================
+
+// key_step<T>::step replaces the value on top of the stack with its field
+// 'key', values that can't be indexed give nil, so a missing intermediate
+// table ends the chain with nil instead of an error
+template <typename T>
+struct key_step {
+	template <typename U>
+	static inline void step(lua_State *L, U &&key) {
+		const int t = lua_type(L, -1);
+		if (t != LUA_TTABLE && t != LUA_TUSERDATA) {
+			lua_pop(L, 1);
+			lua_pushnil(L);
+			return;
+		}
+		push_one(L, std::forward<U>(key));
+		lua_gettable(L, -2);
+		lua_remove(L, -2);
+	}
+};
+
+static inline void recursive_get(lua_State*) {
+	// no keys
+}
+
+template <typename T, typename ...Keys>
+static inline void recursive_get(lua_State *L, T &&key, Keys &&...keys) {
+	key_step<typename std::decay<T>::type>::step(L, std::forward<T>(key));
+	recursive_get(L, std::forward<Keys>(keys)...);
+}
+
+//============================================================================
+// Call result helpers
+//============================================================================
+
+// call_result<R> converts the results of a lua_pcall into R, 'nresults' is
+// how many results R takes from lua. The values are popped after the
+// conversion, the same as with Ref::As<T>() types like const char* are only
+// valid as long as lua keeps the value alive elsewhere.
+template <typename R>
+struct call_result {
+	static constexpr int nresults = 1;
+	static inline R Fail() { return R(); }
+	static inline R Get(lua_State *L, Error *err) {
+		stack_pop p(L, 1);
+		StackOps<Decay<R>>::Check(L, lua_gettop(L), err);
+		if (*err)
+			return R();
+		return StackOps<Decay<R>>::Get(L, -1);
+	}
+};
+
+template <>
+struct call_result<void> {
+	static constexpr int nresults = 0;
+	static inline void Fail() {}
+	static inline void Get(lua_State*, Error*) {}
+};
+
+// calls the function below 'nargs' arguments on top of the stack and converts
+// the results, a failed call or conversion sets 'err' and returns R()
+template <typename R>
+static inline R pcall_result(lua_State *L, int nargs, Error *err) {
+	const int code = lua_pcall(L, nargs, call_result<R>::nresults, 0);
+	if (code != _INTERLUA_OK) {
+		err->Set(code, lua_tostring(L, -1));
+		lua_pop(L, 1); // pop the error message from the stack
+		return call_result<R>::Fail();
+	}
+	return call_result<R>::Get(L, err);
 }
 
 //============================================================================
@@ -1395,7 +2521,11 @@ public:
 	}
 
 	Ref &operator=(Ref &&r) {
-		luaL_unref(L, LUA_REGISTRYINDEX, ref);
+		if (L) {
+			luaL_unref(L, LUA_REGISTRYINDEX, ref);
+			if (tableref != LUA_REFNIL)
+				luaL_unref(L, LUA_REGISTRYINDEX, tableref);
+		}
 		L = r.L;
 		ref = r.ref;
 		tableref = r.tableref;
@@ -1406,6 +2536,10 @@ public:
 	}
 
 	Ref &operator=(const Ref &r) {
+		if (!L)
+			L = r.L;
+		if (!L)
+			return *this;
 		if (tableref != LUA_REFNIL) {
 			stack_pop p(L, 1);
 			lua_rawgeti(L, LUA_REGISTRYINDEX, tableref);
@@ -1437,6 +2571,20 @@ public:
 		return {L, luaL_ref(L, LUA_REGISTRYINDEX)};
 	}
 
+	// same as operator(), but converts the results straight into R, no
+	// registry ref is taken, R = void discards the results,
+	// std::tuple<Ts...> takes one result per element (see interlua_ext.hh)
+	template <typename R, typename ...Args>
+	R Call(Args &&...args) const {
+		Error *err = get_last_if_error(std::forward<Args>(args)...);
+		if (!err)
+			err = &DefaultError;
+
+		Push(L);
+		const int nargs = recursive_push(L, std::forward<Args>(args)...);
+		return pcall_result<R>(L, nargs, err);
+	}
+
 	template <typename T>
 	Ref operator[](T &&key) const {
 		// TODO: make sure Push returns 1
@@ -1447,6 +2595,15 @@ public:
 		return {L, keyref, tableref};
 	}
 
+	// t.Get("a", "b", 1) is t["a"]["b"][1] resolved in one go, the result
+	// is the only registry ref taken, keys can be Paths as well
+	template <typename ...Keys>
+	Ref Get(Keys &&...keys) const {
+		Push(L);
+		recursive_get(L, std::forward<Keys>(keys)...);
+		return {L, luaL_ref(L, LUA_REGISTRYINDEX)};
+	}
+
 	void Push(lua_State *L) const {
 		if (tableref != LUA_REFNIL) {
 			lua_rawgeti(L, LUA_REGISTRYINDEX, tableref);
@@ -1458,6 +2615,8 @@ public:
 		}
 	}
 
+	lua_State *State() const { return L; }
+
 	int Type() const {
 		if (ref != LUA_REFNIL) {
 			stack_pop p(L, 1);
@@ -1482,7 +2641,8 @@ public:
 		Push(L);
 		// TODO: Make sure Push returns 1
 		StackOps<Decay<T>>::Push(L, std::forward<T>(v));
-		luaL_ref(L, -2);
+		// not luaL_ref, since 5.4 it keeps its free list in the table
+		lua_rawseti(L, -2, (int)_interlua_rawlen(L, -2) + 1);
 		lua_pop(L, 1);
 	}
 
@@ -1511,6 +2671,14 @@ static inline Ref FromStack(lua_State *L, int index) {
 	return {L, luaL_ref(L, LUA_REGISTRYINDEX)};
 }
 
+// same as FromStack, but the handle is bound to the main thread, it stays
+// valid when 'L' is a coroutine which is collected later
+static inline Ref main_ref(lua_State *L, int index) {
+	lua_State *main = main_thread(L);
+	lua_pushvalue(L, index);
+	return {main, luaL_ref(L, LUA_REGISTRYINDEX)};
+}
+
 template <typename T>
 static inline Ref New(lua_State *L, T &&v) {
 	// TODO: Make sure Push returns 1
@@ -1541,6 +2709,11 @@ struct StackOps<T> {									\
 	static inline Ref Get(lua_State *L, int index) {				\
 		return FromStack(L, index);						\
 	}										\
+};											\
+											\
+template <>										\
+struct arg_matches<T> {									\
+	static inline bool test(lua_State*, int) { return true; }			\
 };
 
 _stack_ops_ref(Ref)
@@ -1550,4 +2723,542 @@ _stack_ops_ref(const Ref&)
 
 #undef _stack_ops_ref
 
+//============================================================================
+// PinnedString
+//============================================================================
+
+// A lua string kept alive by a Ref. Lua strings never move, so 'ptr' stays
+// valid for as long as the PinnedString (or any of its copies) exists, no
+// bytes are copied. Copies share the same 'ptr' and take a new Ref.
+class PinnedString {
+	Ref ref;
+	const char *ptr = nullptr;
+	size_t len = 0;
+
+public:
+	PinnedString() = default;
+
+	// pins the string at 'index', numbers are converted in place the same
+	// way lua_tolstring does it, other values give an empty PinnedString.
+	// The Ref is bound to the main thread, see LuaFunction.
+	PinnedString(lua_State *L, int index) {
+		ptr = lua_tolstring(L, index, &len);
+		if (ptr)
+			ref = main_ref(L, index);
+	}
+
+	const char *Data() const { return ptr; }
+	size_t Length() const { return len; }
+	bool Empty() const { return len == 0; }
+	StringView View() const { return {ptr, len}; }
+	const Ref &AsRef() const { return ref; }
+
+	void Push(lua_State *L) const {
+		if (ptr)
+			ref.Push(L);
+		else
+			lua_pushnil(L);
+	}
+
+	bool operator==(const PinnedString &r) const {
+		// the same lua string shares the pointer, no need to compare bytes
+		return len == r.len &&
+			(len == 0 || ptr == r.ptr || memcmp(ptr, r.ptr, len) == 0);
+	}
+	bool operator!=(const PinnedString &r) const { return !operator==(r); }
+	bool operator<(const PinnedString &r) const {
+		const size_t n = len < r.len ? len : r.len;
+		const int c = n ? memcmp(ptr, r.ptr, n) : 0;
+		return c < 0 || (c == 0 && len < r.len);
+	}
+	bool operator==(StringView r) const { return View() == r; }
+	bool operator!=(StringView r) const { return View() != r; }
+
+	// FNV-1a over the bytes
+	size_t Hash() const {
+		uint64_t h = 14695981039346656037ULL;
+		for (size_t i = 0; i < len; i++) {
+			h ^= (unsigned char)ptr[i];
+			h *= 1099511628211ULL;
+		}
+		return (size_t)h;
+	}
+};
+
+#define _stack_ops_pinned_string(T)							\
+template <>										\
+struct StackOps<T> {									\
+	static inline int Push(lua_State *L, const PinnedString &v) {			\
+		v.Push(L);								\
+		return 1;								\
+	}										\
+	static inline void Check(lua_State *L, int index, Error *err = &DefaultError) {	\
+		checkstring(L, index, err);						\
+	}										\
+	static inline PinnedString Get(lua_State *L, int index) {			\
+		return {L, index};							\
+	}										\
+};											\
+											\
+template <>										\
+struct arg_matches<T> {									\
+	static inline bool test(lua_State *L, int index) {				\
+		return lua_type(L, index) == LUA_TSTRING;				\
+	}										\
+};
+
+_stack_ops_pinned_string(PinnedString)
+_stack_ops_pinned_string(const PinnedString&)
+_stack_ops_pinned_string(PinnedString&&)
+
+#undef _stack_ops_pinned_string
+
+//============================================================================
+// StackRef
+//============================================================================
+
+// A value pinned on the lua stack instead of the registry. Unlike Ref it
+// never calls luaL_ref/luaL_unref, it's meant for temporaries within a single
+// C++ function. The value is pushed on construction and removed on
+// destruction, hence StackRefs must be destroyed in reverse order of creation,
+// which is what C++ scopes do for local variables (unless NDEBUG is defined,
+// destroying one out of order dies). Use ToRef() for values that outlive the
+// scope, or which are returned to lua by a bound function. Each StackRef
+// takes a stack slot, a lua error is raised when the stack can't grow.
+//
+// Indexing is eager, operator[] pushes the field right away, use Set() to
+// assign fields.
+class StackRef {
+	lua_State *L = nullptr;
+	int index = 0;
+	bool owned = false;
+
+	struct push_tag {};
+
+	// takes over the value on top of the stack
+	StackRef(lua_State *L, push_tag): L(L), index(lua_gettop(L)), owned(true) {}
+
+	static inline void reserve(lua_State *L, int n) {
+		luaL_checkstack(L, n, "too many StackRefs");
+	}
+
+	// refers to the value at 'index' without owning it
+	StackRef(lua_State *L, int index, bool):
+		L(L), index(_interlua_absindex(L, index)) {}
+
+	template <typename ...Args>
+	void call(Args &&...args) const {
+		Error *err = get_last_if_error(std::forward<Args>(args)...);
+		if (!err)
+			err = &DefaultError;
+
+		reserve(L, sizeof...(Args) + 1);
+		lua_pushvalue(L, index);
+		const int nargs = recursive_push(L, std::forward<Args>(args)...);
+		const int code = lua_pcall(L, nargs, 1, 0);
+		if (code != _INTERLUA_OK) {
+			err->Set(code, lua_tostring(L, -1));
+			lua_pop(L, 1); // pop the error message from the stack
+			lua_pushnil(L);
+		}
+	}
+
+	template <typename T>
+	void get(T &&key) const {
+		reserve(L, 1);
+		push_one(L, std::forward<T>(key));
+		lua_gettable(L, index);
+	}
+
+	// moves the value on top of the stack into our own slot
+	StackRef reuse_slot() {
+		if (!owned)
+			return Top(L);
+		lua_replace(L, index);
+		return std::move(*this);
+	}
+
+public:
+	StackRef() = default;
+
+	// pins a copy of the value at 'index'
+	StackRef(lua_State *L, int index): L(L), owned(true) {
+		reserve(L, 1);
+		lua_pushvalue(L, index);
+		this->index = lua_gettop(L);
+	}
+
+	StackRef(const StackRef&) = delete;
+	StackRef &operator=(const StackRef&) = delete;
+
+	StackRef(StackRef &&r): L(r.L), index(r.index), owned(r.owned) {
+		r.L = nullptr;
+		r.owned = false;
+	}
+
+	~StackRef() {
+		if (!owned)
+			return;
+#ifndef NDEBUG
+		if (index != lua_gettop(L))
+			die("StackRef at %d destroyed out of order, the top is %d",
+				index, lua_gettop(L));
+#endif
+		lua_remove(L, index);
+	}
+
+	// takes over the value on top of the stack, makes sure there is room
+	// for the next one
+	static StackRef Top(lua_State *L) {
+		reserve(L, 1);
+		return {L, push_tag()};
+	}
+
+	// refers to an existing stack slot, e.g. a function argument, the slot
+	// is not popped on destruction
+	static StackRef At(lua_State *L, int index) { return {L, index, false}; }
+
+	static StackRef Global(lua_State *L, const char *name) {
+		reserve(L, 1);
+		lua_getglobal(L, name);
+		return Top(L);
+	}
+
+	static StackRef NewTable(lua_State *L) {
+		reserve(L, 1);
+		lua_newtable(L);
+		return Top(L);
+	}
+
+	template <typename T>
+	static StackRef New(lua_State *L, T &&v) {
+		reserve(L, 1);
+		push_one(L, std::forward<T>(v));
+		return Top(L);
+	}
+
+	int Index() const { return index; }
+
+	Ref ToRef() const {
+		reserve(L, 1);
+		lua_pushvalue(L, index);
+		return {L, luaL_ref(L, LUA_REGISTRYINDEX)};
+	}
+
+#define _generic_op(op, luaop, self_first)					\
+	template <typename T>							\
+	bool op(T &&r) const {							\
+		reserve(L, 1);							\
+		push_one(L, std::forward<T>(r));				\
+		stack_pop p(L, 1);						\
+		return self_first ?						\
+			_interlua_compare(L, index, -1, luaop) == 1 :		\
+			_interlua_compare(L, -1, index, luaop) == 1;		\
+	}
+
+	_generic_op(operator==, _INTERLUA_OPEQ, true)
+	_generic_op(operator<, _INTERLUA_OPLT, true)
+	_generic_op(operator<=, _INTERLUA_OPLE, true)
+	_generic_op(operator>, _INTERLUA_OPLT, false)
+	_generic_op(operator>=, _INTERLUA_OPLE, false)
+
+#undef _generic_op
+
+	template <typename T>
+	bool operator!=(T &&r) const {
+		return !operator==(std::forward<T>(r));
+	}
+
+	template <typename ...Args>
+	StackRef operator()(Args &&...args) const & {
+		call(std::forward<Args>(args)...);
+		return Top(L);
+	}
+
+	template <typename T>
+	StackRef operator[](T &&key) const & {
+		get(std::forward<T>(key));
+		return Top(L);
+	}
+
+	// temporaries reuse their own slot for the result, this way chains like
+	// t["a"]["b"] or t["f"](1) don't leave holes in the middle of the stack
+	template <typename ...Args>
+	StackRef operator()(Args &&...args) && {
+		call(std::forward<Args>(args)...);
+		return reuse_slot();
+	}
+
+	template <typename T>
+	StackRef operator[](T &&key) && {
+		get(std::forward<T>(key));
+		return reuse_slot();
+	}
+
+	// same as Ref::Get(), the result takes a single stack slot
+	template <typename ...Keys>
+	StackRef Get(Keys &&...keys) const & {
+		reserve(L, 2);
+		lua_pushvalue(L, index);
+		recursive_get(L, std::forward<Keys>(keys)...);
+		return Top(L);
+	}
+
+	template <typename ...Keys>
+	StackRef Get(Keys &&...keys) && {
+		reserve(L, 2);
+		lua_pushvalue(L, index);
+		recursive_get(L, std::forward<Keys>(keys)...);
+		return reuse_slot();
+	}
+
+	template <typename K, typename V>
+	void Set(K &&key, V &&v) const {
+		reserve(L, 2);
+		push_one(L, std::forward<K>(key));
+		push_one(L, std::forward<V>(v));
+		lua_settable(L, index);
+	}
+
+	void Push(lua_State *L) const {
+		lua_pushvalue(this->L, index);
+		if (L != this->L)
+			lua_xmove(this->L, L, 1);
+	}
+
+	int Type() const {
+		return L ? lua_type(L, index) : LUA_TNIL;
+	}
+
+	inline bool IsNil() const { return Type() == LUA_TNIL; }
+	inline bool IsNumber() const { return Type() == LUA_TNUMBER; }
+	inline bool IsString() const { return Type() == LUA_TSTRING; }
+	inline bool IsTable() const { return Type() == LUA_TTABLE; }
+	inline bool IsFunction() const { return Type() == LUA_TFUNCTION; }
+	inline bool IsUserdata() const { return Type() == LUA_TUSERDATA; }
+	inline bool IsThread() const { return Type() == LUA_TTHREAD; }
+	inline bool IsLightUserdata() const { return Type() == LUA_TLIGHTUSERDATA; }
+
+	template <typename T>
+	void Append(T &&v) const {
+		reserve(L, 1);
+		push_one(L, std::forward<T>(v));
+		lua_rawseti(L, index, (int)_interlua_rawlen(L, index) + 1);
+	}
+
+	int Length() const {
+		return _interlua_rawlen(L, index);
+	}
+
+	// the value stays on the stack, so unlike Ref::As<const char*>() the
+	// returned pointer is valid for as long as the StackRef exists
+	template <typename T>
+	inline T As() const {
+		StackOps<Decay<T>>::Check(L, index, &DefaultError);
+		return StackOps<Decay<T>>::Get(L, index);
+	}
+
+	template <typename T>
+	inline operator T() const {
+		return As<T>();
+	}
+};
+
+// as a bound function argument StackRef refers to the argument slot directly
+#define _stack_ops_stack_ref(T)								\
+template <>										\
+struct StackOps<T> {									\
+	static inline int Push(lua_State *L, const StackRef &v) {			\
+		v.Push(L);								\
+		return 1;								\
+	}										\
+	static inline void Check(lua_State *L, int narg, Error *err = &DefaultError) {	\
+		checkany(L, narg, err);							\
+	}										\
+	static inline StackRef Get(lua_State *L, int index) {				\
+		return StackRef::At(L, index);						\
+	}										\
+};											\
+											\
+template <>										\
+struct arg_matches<T> {									\
+	static inline bool test(lua_State*, int) { return true; }			\
+};
+
+_stack_ops_stack_ref(StackRef)
+_stack_ops_stack_ref(StackRef&)
+_stack_ops_stack_ref(StackRef&&)
+_stack_ops_stack_ref(const StackRef&)
+
+#undef _stack_ops_stack_ref
+
+//============================================================================
+// Path
+//============================================================================
+
+// A compiled chain of keys, "server.pool.size" or "servers.1.host". Keys are
+// split at dots, segments made of digits only become integer keys. The keys
+// are pushed once and kept in a lua table, resolving a path fetches them
+// with lua_rawgeti instead of hashing the strings again, which makes it
+// cheap to reuse in a loop: t.Get(path).
+class Path {
+	Ref keys;
+	int n = 0;
+
+public:
+	Path() = default;
+	Path(lua_State *L, const char *path) {
+		lua_newtable(L);
+		const char *p = path;
+		while (*p) {
+			const char *end = strchr(p, '.');
+			if (!end)
+				end = p + strlen(p);
+			const size_t len = end - p;
+			if (len > 0) {
+				if (len == strspn(p, "0123456789"))
+					lua_pushinteger(L, (lua_Integer)strtoll(p, nullptr, 10));
+				else
+					lua_pushlstring(L, p, len);
+				lua_rawseti(L, -2, ++n);
+			}
+			p = *end ? end + 1 : end;
+		}
+		keys = Ref(L, luaL_ref(L, LUA_REGISTRYINDEX));
+	}
+
+	int Length() const { return n; }
+
+	// replaces the value on top of the stack with the value at the path
+	void Resolve(lua_State *L) const {
+		keys.Push(L);
+		for (int i = 1; i <= n; i++) {
+			const int t = lua_type(L, -2);
+			if (t != LUA_TTABLE && t != LUA_TUSERDATA) {
+				lua_pushnil(L);
+				lua_replace(L, -3);
+				break;
+			}
+			lua_rawgeti(L, -1, i);
+			lua_gettable(L, -3);
+			lua_replace(L, -3);
+		}
+		lua_pop(L, 1);
+	}
+};
+
+template <>
+struct key_step<Path> {
+	static inline void step(lua_State *L, const Path &path) {
+		path.Resolve(L);
+	}
+};
+
+//============================================================================
+// LuaFunction
+//============================================================================
+
+template <typename Signature>
+class LuaFunction;
+
+// A lua function with a fixed C++ signature. Unlike Ref::operator(), calling
+// it takes no registry refs: the arguments are pushed after a single stack
+// space check and the result is converted with StackOps<R> right off the
+// stack. For void functions lua discards the results (nresults = 0).
+//
+// The handle is bound to the main thread, it stays valid when it's created
+// inside a coroutine which is collected later. Calls without a lua_State run
+// on the main thread too, C++ code called from a coroutine passes its own
+// state to Call instead.
+template <typename R, typename ...Args>
+class LuaFunction<R (Args...)> {
+	Ref fn;
+
+public:
+	LuaFunction() = default;
+	LuaFunction(Ref f) {
+		lua_State *L = f.State();
+		if (!L)
+			return;
+		lua_State *main = main_thread(L);
+		if (L == main) {
+			fn = std::move(f);
+			return;
+		}
+		f.Push(L);
+		fn = Ref(main, luaL_ref(L, LUA_REGISTRYINDEX));
+	}
+	LuaFunction(lua_State *L, const char *name) {
+		lua_getglobal(L, name);
+		fn = Ref(main_thread(L), luaL_ref(L, LUA_REGISTRYINDEX));
+	}
+
+	// takes the value at 'index'
+	LuaFunction(lua_State *L, int index): fn(main_ref(L, index)) {}
+
+	const Ref &AsRef() const { return fn; }
+	bool IsFunction() const { return fn.IsFunction(); }
+
+	R operator()(Args ...args) const {
+		return Call(&DefaultError, std::forward<Args>(args)...);
+	}
+
+	R Call(Error *err, Args ...args) const {
+		return Call(fn.State(), err, std::forward<Args>(args)...);
+	}
+
+	// calls the function on 'L', which is any thread of the state the
+	// handle belongs to, e.g. the coroutine running the calling binding
+	R Call(lua_State *L, Error *err, Args ...args) const {
+		if (!lua_checkstack(L, sizeof...(Args) + 1)) {
+			err->Set(LUA_ERRRUN, "stack overflow");
+			return call_result<R>::Fail();
+		}
+		fn.Push(L);
+		const int nargs = recursive_push(L, std::forward<Args>(args)...);
+		return pcall_result<R>(L, nargs, err);
+	}
+};
+
+template <typename R, typename ...Args>
+struct StackOps<LuaFunction<R (Args...)>> {
+	static inline int Push(lua_State *L, const LuaFunction<R (Args...)> &f) {
+		f.AsRef().Push(L);
+		return 1;
+	}
+	static inline void Check(lua_State *L, int index, Error *err = &DefaultError) {
+		checkfunction(L, index, err);
+	}
+	static inline LuaFunction<R (Args...)> Get(lua_State *L, int index) {
+		return {L, index};
+	}
+};
+
+template <typename R, typename ...Args>
+struct arg_matches<LuaFunction<R (Args...)>> {
+	static inline bool test(lua_State *L, int index) {
+		return lua_type(L, index) == LUA_TFUNCTION;
+	}
+};
+
+template <typename R, typename ...Args>
+struct StackOps<const LuaFunction<R (Args...)>&> : StackOps<LuaFunction<R (Args...)>> {};
+template <typename R, typename ...Args>
+struct StackOps<LuaFunction<R (Args...)>&&> : StackOps<LuaFunction<R (Args...)>> {};
+template <typename R, typename ...Args>
+struct arg_matches<const LuaFunction<R (Args...)>&> : arg_matches<LuaFunction<R (Args...)>> {};
+template <typename R, typename ...Args>
+struct arg_matches<LuaFunction<R (Args...)>&&> : arg_matches<LuaFunction<R (Args...)>> {};
+
 } // namespace InterLua
+
+namespace std {
+
+template <>
+struct hash<InterLua::PinnedString> {
+	size_t operator()(const InterLua::PinnedString &s) const {
+		return s.Hash();
+	}
+};
+
+} // namespace std
@@ -1,5 +1,13 @@
 #include "interlua.hh"
 #include <tuple>
+#include <string>
+#include <vector>
+#include <array>
+#include <map>
+#include <unordered_map>
+#include <cstdio>
+#include <cmath>
+#include <limits>
 
 namespace InterLua {
 
@@ -33,25 +41,1291 @@ static inline int recursive_tuple_push(lua_State *L, T &&r) {
 	>::push(L, std::forward<T>(r));
 }
 
-template <typename ...Args>
-struct StackOps<std::tuple<Args...>> {
-	static inline int Push(lua_State *L, std::tuple<Args...> v) {
+// std::tuple and std::pair are pushed as multiple values. As arguments they
+// are lua arrays, {1, "x"} for std::tuple<int, const char*>, elements are
+// checked and converted with StackOps of their types.
+
+template <typename T>
+static inline bool element_matches(lua_State *L, int index, int i) {
+	lua_rawgeti(L, index, i);
+	const bool ok = arg_matches<Decay<T>>::test(L, -1);
+	lua_pop(L, 1);
+	return ok;
+}
+
+template <typename T>
+static inline Decay<T> get_field(lua_State *L, int index, int i) {
+	stack_pop p(L, 1);
+	lua_rawgeti(L, index, i);
+	return StackOps<Decay<T>>::Get(L, -1);
+}
+
+template <typename T, typename IT = index_tuple<std::tuple_size<T>::value>>
+struct tuple_ops;
+
+template <typename ...Ts, int ...I>
+struct tuple_ops<std::tuple<Ts...>, index_tuple_type<I...>> {
+	// index of the first element of the table at 'index' which can't be
+	// passed as its tuple element, 0 if there is none
+	static int mismatch(lua_State *L, int index) {
+		index = _interlua_absindex(L, index);
+		int bad = 0;
+		int unused[] = {0, (bad = bad ? bad :
+			element_matches<Ts>(L, index, I+1) ? 0 : I+1)...};
+		(void)unused;
+		return bad;
+	}
+
+	static void check(lua_State *L, int index, Error *err) {
+		checktable(L, index, err);
+		if (*err)
+			return;
+		if (int i = mismatch(L, index)) {
+			char msg[64];
+			snprintf(msg, sizeof(msg), "wrong type of element #%d", i);
+			argerror(L, index, msg, err);
+		}
+	}
+
+	static std::tuple<Ts...> get(lua_State *L, int index) {
+		index = _interlua_absindex(L, index);
+		return std::tuple<Ts...>(get_field<Ts>(L, index, I+1)...);
+	}
+
+	// results of a lua call, the last sizeof...(Ts) values on the stack
+	static void check_results(lua_State *L, Error *err) {
+		const int base = lua_gettop(L) - (int)sizeof...(Ts) + 1;
+		int unused[] = {0, (*err ? 0 :
+			(StackOps<Decay<Ts>>::Check(L, base + I, err), 0))...};
+		(void)unused;
+	}
+
+	static std::tuple<Ts...> get_results(lua_State *L) {
+		const int base = lua_gettop(L) - (int)sizeof...(Ts) + 1;
+		return std::tuple<Ts...>(StackOps<Decay<Ts>>::Get(L, base + I)...);
+	}
+};
+
+template <typename ...Ts>
+struct StackOps<std::tuple<Ts...>> {
+	using ops = tuple_ops<std::tuple<Ts...>>;
+	static inline int Push(lua_State *L, std::tuple<Ts...> v) {
 		return recursive_tuple_push(L, std::move(v));
 	}
+	static inline void Check(lua_State *L, int index, Error *err = &DefaultError) {
+		ops::check(L, index, err);
+	}
+	static inline std::tuple<Ts...> Get(lua_State *L, int index) {
+		return ops::get(L, index);
+	}
+	// tuples of trivially destructible elements are passed in a single
+	// pass, see is_lj_safe
+	static inline std::tuple<Ts...> LJGet(lua_State *L, int index) {
+		ManualError merr;
+		Check(L, index, merr.Init());
+		merr.LJCheckAndDestroy(L);
+		return Get(L, index);
+	}
+};
+
+template <typename ...Ts>
+struct arg_matches<std::tuple<Ts...>> {
+	static inline bool test(lua_State *L, int index) {
+		return lua_type(L, index) == LUA_TTABLE &&
+			tuple_ops<std::tuple<Ts...>>::mismatch(L, index) == 0;
+	}
+};
+
+template <typename A, typename B>
+struct StackOps<std::pair<A, B>> {
+	using ops = tuple_ops<std::tuple<A, B>>;
+	static inline int Push(lua_State *L, const std::pair<A, B> &v) {
+		const int n = StackOps<Decay<const A&>>::Push(L, v.first);
+		return n + StackOps<Decay<const B&>>::Push(L, v.second);
+	}
+	static inline void Check(lua_State *L, int index, Error *err = &DefaultError) {
+		ops::check(L, index, err);
+	}
+	static inline std::pair<A, B> Get(lua_State *L, int index) {
+		index = _interlua_absindex(L, index);
+		return {get_field<A>(L, index, 1), get_field<B>(L, index, 2)};
+	}
+	static inline std::pair<A, B> LJGet(lua_State *L, int index) {
+		ManualError merr;
+		Check(L, index, merr.Init());
+		merr.LJCheckAndDestroy(L);
+		return Get(L, index);
+	}
+};
+
+template <typename A, typename B>
+struct arg_matches<std::pair<A, B>> {
+	static inline bool test(lua_State *L, int index) {
+		return lua_type(L, index) == LUA_TTABLE &&
+			tuple_ops<std::tuple<A, B>>::mismatch(L, index) == 0;
+	}
+};
+
+template <typename ...Ts>
+struct StackOps<std::tuple<Ts...>&> : StackOps<std::tuple<Ts...>> {};
+template <typename ...Ts>
+struct StackOps<std::tuple<Ts...>&&> : StackOps<std::tuple<Ts...>> {};
+template <typename ...Ts>
+struct StackOps<const std::tuple<Ts...>&> : StackOps<std::tuple<Ts...>> {};
+template <typename ...Ts>
+struct arg_matches<const std::tuple<Ts...>&> : arg_matches<std::tuple<Ts...>> {};
+template <typename ...Ts>
+struct arg_matches<std::tuple<Ts...>&&> : arg_matches<std::tuple<Ts...>> {};
+
+template <typename A, typename B>
+struct StackOps<std::pair<A, B>&> : StackOps<std::pair<A, B>> {};
+template <typename A, typename B>
+struct StackOps<std::pair<A, B>&&> : StackOps<std::pair<A, B>> {};
+template <typename A, typename B>
+struct StackOps<const std::pair<A, B>&> : StackOps<std::pair<A, B>> {};
+template <typename A, typename B>
+struct arg_matches<const std::pair<A, B>&> : arg_matches<std::pair<A, B>> {};
+template <typename A, typename B>
+struct arg_matches<std::pair<A, B>&&> : arg_matches<std::pair<A, B>> {};
+
+// calling lua, a tuple or a pair takes one result per element
+
+template <typename ...Ts>
+struct call_result<std::tuple<Ts...>> {
+	static constexpr int nresults = sizeof...(Ts);
+	static inline std::tuple<Ts...> Fail() { return std::tuple<Ts...>(); }
+	static inline std::tuple<Ts...> Get(lua_State *L, Error *err) {
+		using ops = tuple_ops<std::tuple<Ts...>>;
+		stack_pop p(L, nresults);
+		ops::check_results(L, err);
+		if (*err)
+			return Fail();
+		return ops::get_results(L);
+	}
 };
 
-#define _stack_ops_tuple(T)						\
-template <typename ...Args>						\
-struct StackOps<T> {							\
-	static inline int Push(lua_State *L, T v) {			\
-		return recursive_tuple_push(L, std::forward<T>(v));	\
-	}								\
+template <typename A, typename B>
+struct call_result<std::pair<A, B>> {
+	static constexpr int nresults = 2;
+	static inline std::pair<A, B> Fail() { return std::pair<A, B>(); }
+	static inline std::pair<A, B> Get(lua_State *L, Error *err) {
+		auto t = call_result<std::tuple<A, B>>::Get(L, err);
+		return {std::move(std::get<0>(t)), std::move(std::get<1>(t))};
+	}
+};
+
+//============================================================================
+// std::string
+//============================================================================
+
+// strings are pushed with their length, lua strings are copied into
+// std::string as is, including '\0' bytes
+#define _stack_ops_string(T)							\
+template <>									\
+struct StackOps<T> {								\
+	static inline int Push(lua_State *L, const std::string &v) {		\
+		lua_pushlstring(L, v.data(), v.size());				\
+		return 1;							\
+	}									\
+	static inline void Check(lua_State *L, int index, Error *err = &DefaultError) { \
+		checkstring(L, index, err);					\
+	}									\
+	static inline std::string Get(lua_State *L, int index) {		\
+		size_t len;							\
+		const char *s = lua_tolstring(L, index, &len);			\
+		return {s, len};						\
+	}									\
+	static inline std::string LJGet(lua_State *L, int index) {		\
+		size_t len;							\
+		const char *s = luaL_checklstring(L, index, &len);		\
+		return {s, len};						\
+	}									\
+};										\
+										\
+template <>									\
+struct arg_matches<T> {								\
+	static inline bool test(lua_State *L, int index) {			\
+		return lua_type(L, index) == LUA_TSTRING;			\
+	}									\
 };
 
-_stack_ops_tuple(std::tuple<Args...>&)
-_stack_ops_tuple(std::tuple<Args...>&&)
-_stack_ops_tuple(const std::tuple<Args...>&)
+_stack_ops_string(std::string)
+_stack_ops_string(const std::string&)
+_stack_ops_string(std::string&&)
+
+#undef _stack_ops_string
+
+//============================================================================
+// Containers
+//============================================================================
+
+// std::vector and std::array are lua arrays, std::map and std::unordered_map
+// are lua tables. Elements are converted with StackOps of their types, tables
+// are created presized, so filling them never rehashes.
+
+template <typename T>
+static inline void push_element(lua_State *L, const T &v) {
+	StackOps<Decay<const T&>>::Push(L, v);
+}
+
+template <typename T>
+static inline Decay<T> get_element(lua_State *L, int index) {
+	return StackOps<Decay<T>>::Get(L, index);
+}
+
+// returns the index of the first of 'n' array elements (all of them if 'n' is
+// -1) of the table at 'index' which can't be passed as T, 0 if there is none
+template <typename T>
+static int array_mismatch(lua_State *L, int index, int n) {
+	index = _interlua_absindex(L, index);
+	if (n < 0)
+		n = _interlua_rawlen(L, index);
+	for (int i = 1; i <= n; i++) {
+		lua_rawgeti(L, index, i);
+		const bool ok = arg_matches<Decay<T>>::test(L, -1);
+		lua_pop(L, 1);
+		if (!ok)
+			return i;
+	}
+	return 0;
+}
+
+// true, if all the keys and values of the table at 'index' can be passed as K
+// and V
+template <typename K, typename V>
+static bool table_matches(lua_State *L, int index) {
+	index = _interlua_absindex(L, index);
+	lua_pushnil(L);
+	while (lua_next(L, index)) {
+		if (!arg_matches<Decay<K>>::test(L, -2) ||
+			!arg_matches<Decay<V>>::test(L, -1))
+		{
+			lua_pop(L, 2);
+			return false;
+		}
+		lua_pop(L, 1);
+	}
+	return true;
+}
+
+template <typename T>
+static void check_array(lua_State *L, int index, int n, Error *err) {
+	checktable(L, index, err);
+	if (*err)
+		return;
+	if (int i = array_mismatch<T>(L, index, n)) {
+		char msg[64];
+		snprintf(msg, sizeof(msg), "wrong type of element #%d", i);
+		argerror(L, index, msg, err);
+	}
+}
+
+template <typename K, typename V>
+static void check_table(lua_State *L, int index, Error *err) {
+	checktable(L, index, err);
+	if (*err)
+		return;
+	if (!table_matches<K, V>(L, index))
+		argerror(L, index, "wrong type of a table key or value", err);
+}
+
+template <typename C>
+static int push_array(lua_State *L, const C &c) {
+	using T = typename C::value_type;
+	lua_createtable(L, (int)c.size(), 0);
+	int i = 1;
+	for (const T &v : c) {
+		push_element<T>(L, v);
+		lua_rawseti(L, -2, i++);
+	}
+	return 1;
+}
+
+template <typename C>
+static int push_table(lua_State *L, const C &c) {
+	using K = typename C::key_type;
+	using V = typename C::mapped_type;
+	lua_createtable(L, 0, (int)c.size());
+	for (const auto &kv : c) {
+		push_element<K>(L, kv.first);
+		push_element<V>(L, kv.second);
+		lua_rawset(L, -3);
+	}
+	return 1;
+}
+
+template <typename C>
+static C get_table(lua_State *L, int index) {
+	using K = typename C::key_type;
+	using V = typename C::mapped_type;
+	index = _interlua_absindex(L, index);
+	C out;
+	lua_pushnil(L);
+	while (lua_next(L, index)) {
+		// the conversion may change the key in place (lua_tolstring),
+		// lua_next needs the original one, convert a copy
+		lua_pushvalue(L, -2);
+		out.emplace(get_element<K>(L, -1), get_element<V>(L, -2));
+		lua_pop(L, 2);
+	}
+	return out;
+}
+
+// std::vector
+
+template <typename T, typename A>
+struct StackOps<std::vector<T, A>> {
+	static inline int Push(lua_State *L, const std::vector<T, A> &v) {
+		return push_array(L, v);
+	}
+	static inline void Check(lua_State *L, int index, Error *err = &DefaultError) {
+		check_array<T>(L, index, -1, err);
+	}
+	static inline std::vector<T, A> Get(lua_State *L, int index) {
+		index = _interlua_absindex(L, index);
+		const int n = _interlua_rawlen(L, index);
+		std::vector<T, A> out;
+		out.reserve(n);
+		for (int i = 1; i <= n; i++) {
+			lua_rawgeti(L, index, i);
+			out.push_back(get_element<T>(L, -1));
+			lua_pop(L, 1);
+		}
+		return out;
+	}
+};
+
+template <typename T, typename A>
+struct arg_matches<std::vector<T, A>> {
+	static inline bool test(lua_State *L, int index) {
+		return lua_type(L, index) == LUA_TTABLE &&
+			array_mismatch<T>(L, index, -1) == 0;
+	}
+};
+
+// std::array, the table has to have at least N elements
+
+template <typename T, size_t N>
+struct StackOps<std::array<T, N>> {
+	static inline int Push(lua_State *L, const std::array<T, N> &v) {
+		return push_array(L, v);
+	}
+	static inline void Check(lua_State *L, int index, Error *err = &DefaultError) {
+		check_array<T>(L, index, N, err);
+	}
+	static inline std::array<T, N> Get(lua_State *L, int index) {
+		index = _interlua_absindex(L, index);
+		std::array<T, N> out;
+		for (size_t i = 0; i < N; i++) {
+			lua_rawgeti(L, index, i+1);
+			out[i] = get_element<T>(L, -1);
+			lua_pop(L, 1);
+		}
+		return out;
+	}
+	// arrays of trivially destructible elements are passed in a single
+	// pass, see is_lj_safe
+	static inline std::array<T, N> LJGet(lua_State *L, int index) {
+		ManualError merr;
+		Check(L, index, merr.Init());
+		merr.LJCheckAndDestroy(L);
+		return Get(L, index);
+	}
+};
+
+template <typename T, size_t N>
+struct arg_matches<std::array<T, N>> {
+	static inline bool test(lua_State *L, int index) {
+		return lua_type(L, index) == LUA_TTABLE &&
+			array_mismatch<T>(L, index, N) == 0;
+	}
+};
+
+// std::map and std::unordered_map
+
+template <typename C>
+struct table_stack_ops {
+	using K = typename C::key_type;
+	using V = typename C::mapped_type;
+	static inline int Push(lua_State *L, const C &v) {
+		return push_table(L, v);
+	}
+	static inline void Check(lua_State *L, int index, Error *err = &DefaultError) {
+		check_table<K, V>(L, index, err);
+	}
+	static inline C Get(lua_State *L, int index) {
+		return get_table<C>(L, index);
+	}
+};
+
+template <typename C>
+struct table_arg_matches {
+	static inline bool test(lua_State *L, int index) {
+		return lua_type(L, index) == LUA_TTABLE && table_matches<
+			typename C::key_type,
+			typename C::mapped_type
+		>(L, index);
+	}
+};
+
+template <typename K, typename V, typename C, typename A>
+struct StackOps<std::map<K, V, C, A>> :
+	table_stack_ops<std::map<K, V, C, A>> {};
+
+template <typename K, typename V, typename C, typename A>
+struct arg_matches<std::map<K, V, C, A>> :
+	table_arg_matches<std::map<K, V, C, A>> {};
+
+template <typename K, typename V, typename H, typename E, typename A>
+struct StackOps<std::unordered_map<K, V, H, E, A>> :
+	table_stack_ops<std::unordered_map<K, V, H, E, A>> {};
+
+template <typename K, typename V, typename H, typename E, typename A>
+struct arg_matches<std::unordered_map<K, V, H, E, A>> :
+	table_arg_matches<std::unordered_map<K, V, H, E, A>> {};
+
+// references to containers are passed as copies, same as std::string
+
+template <typename T, typename A>
+struct StackOps<const std::vector<T, A>&> : StackOps<std::vector<T, A>> {};
+template <typename T, typename A>
+struct StackOps<std::vector<T, A>&&> : StackOps<std::vector<T, A>> {};
+template <typename T, typename A>
+struct arg_matches<const std::vector<T, A>&> : arg_matches<std::vector<T, A>> {};
+template <typename T, typename A>
+struct arg_matches<std::vector<T, A>&&> : arg_matches<std::vector<T, A>> {};
+
+template <typename T, size_t N>
+struct StackOps<const std::array<T, N>&> : StackOps<std::array<T, N>> {};
+template <typename T, size_t N>
+struct StackOps<std::array<T, N>&&> : StackOps<std::array<T, N>> {};
+template <typename T, size_t N>
+struct arg_matches<const std::array<T, N>&> : arg_matches<std::array<T, N>> {};
+template <typename T, size_t N>
+struct arg_matches<std::array<T, N>&&> : arg_matches<std::array<T, N>> {};
+
+template <typename K, typename V, typename C, typename A>
+struct StackOps<const std::map<K, V, C, A>&> : StackOps<std::map<K, V, C, A>> {};
+template <typename K, typename V, typename C, typename A>
+struct StackOps<std::map<K, V, C, A>&&> : StackOps<std::map<K, V, C, A>> {};
+template <typename K, typename V, typename C, typename A>
+struct arg_matches<const std::map<K, V, C, A>&> : arg_matches<std::map<K, V, C, A>> {};
+template <typename K, typename V, typename C, typename A>
+struct arg_matches<std::map<K, V, C, A>&&> : arg_matches<std::map<K, V, C, A>> {};
+
+template <typename K, typename V, typename H, typename E, typename A>
+struct StackOps<const std::unordered_map<K, V, H, E, A>&> :
+	StackOps<std::unordered_map<K, V, H, E, A>> {};
+template <typename K, typename V, typename H, typename E, typename A>
+struct StackOps<std::unordered_map<K, V, H, E, A>&&> :
+	StackOps<std::unordered_map<K, V, H, E, A>> {};
+template <typename K, typename V, typename H, typename E, typename A>
+struct arg_matches<const std::unordered_map<K, V, H, E, A>&> :
+	arg_matches<std::unordered_map<K, V, H, E, A>> {};
+template <typename K, typename V, typename H, typename E, typename A>
+struct arg_matches<std::unordered_map<K, V, H, E, A>&&> :
+	arg_matches<std::unordered_map<K, V, H, E, A>> {};
+
+//============================================================================
+// Container proxies
+//============================================================================
+
+// A reference to a C++ container, which is pushed to lua as a userdata proxy
+// instead of a table copy. The proxy supports indexing, assignment, the
+// length operator, pairs() and ipairs() (__pairs and __ipairs are honoured
+// since lua 5.2) and operates on the container directly. Like a pointer, the
+// proxy doesn't own the container: it must outlive the userdata.
+//
+// Elements of bound classes are pushed as pointers to the elements, others
+// (numbers, strings, ...) are pushed by value with their StackOps, the access
+// allocates nothing. std::vector grows when assigning to #v+1, assigning nil
+// to a map key erases it. Like with lua tables, fields may be erased during
+// pairs(), but not added. Proxies of const containers are read-only.
+template <typename C>
+class ContainerRef {
+	C *ptr = nullptr;
+
+public:
+	ContainerRef() = default;
+	ContainerRef(C &c): ptr(&c) {}
+
+	C &operator*() const { return *ptr; }
+	C *operator->() const { return ptr; }
+	C *Get() const { return ptr; }
+};
+
+template <typename T>
+static inline auto push_element_ref(lua_State *L, T &v, int)
+	-> decltype(StackOps<typename std::remove_const<T>::type>::Emplace(L), void())
+{
+	StackOps<T*>::Push(L, &v);
+}
+
+template <typename T>
+static inline void push_element_ref(lua_State *L, T &v, long) {
+	push_element<typename std::remove_const<T>::type>(L, v);
+}
+
+// pushes the element 'i' of a sequence
+template <typename C>
+static inline void push_sequence_element(lua_State *L, C &c, size_t i) {
+	push_element_ref(L, c[i], 0);
+}
+
+// std::vector<bool> has no bool& elements, its operator[] returns a bit
+// reference (or a bool if the vector is const)
+template <typename A>
+static inline void push_sequence_element(lua_State *L, std::vector<bool, A> &c, size_t i) {
+	lua_pushboolean(L, c[i]);
+}
+
+template <typename A>
+static inline void push_sequence_element(lua_State *L, const std::vector<bool, A> &c, size_t i) {
+	lua_pushboolean(L, c[i]);
+}
+
+// raises a lua error if the value at 'index' can't be passed as T, it's called
+// before any object with a destructor is created (lua errors are longjmps)
+template <typename T>
+static inline void check_element(lua_State *L, int index) {
+	ManualError merr;
+	StackOps<Decay<T>>::Check(L, index, merr.Init());
+	merr.LJCheckAndDestroy(L);
+}
+
+template <typename C>
+static inline C &container_self(lua_State *L) {
+	return **(C**)lua_touserdata(L, 1);
+}
+
+static int container_readonly(lua_State *L) {
+	return luaL_error(L, "the container is read-only");
+}
+
+template <typename C>
+static int container_len(lua_State *L) {
+	lua_pushinteger(L, container_self<C>(L).size());
+	return 1;
+}
+
+// std::vector and std::array
 
-#undef _stack_ops_tuple
+// only std::vector can grow
+template <typename C>
+static inline bool append_element(lua_State*, C&) { return false; }
+
+template <typename T, typename A>
+static inline bool append_element(lua_State *L, std::vector<T, A> &v) {
+	check_element<T>(L, 3);
+	v.push_back(get_element<T>(L, 3));
+	return true;
+}
+
+template <typename C>
+struct sequence_proxy {
+	// returns the 0-based index of the element for the key at 'index', -1
+	// if there is no such element
+	static inline long element_index(lua_State *L, int index) {
+		if (lua_type(L, index) != LUA_TNUMBER)
+			return -1;
+		lua_Integer i = lua_tointeger(L, index);
+		if (i < 1 || (size_t)i > container_self<C>(L).size())
+			return -1;
+		return (long)i - 1;
+	}
+
+	static int index(lua_State *L) {
+		long i = element_index(L, 2);
+		if (i < 0)
+			return 0;
+		push_sequence_element(L, container_self<C>(L), i);
+		return 1;
+	}
+
+	static int newindex(lua_State *L) {
+		auto &c = container_self<C>(L);
+		long i = element_index(L, 2);
+		if (i >= 0) {
+			check_element<typename C::value_type>(L, 3);
+			c[i] = get_element<typename C::value_type>(L, 3);
+			return 0;
+		}
+		if (lua_type(L, 2) == LUA_TNUMBER &&
+			lua_tointeger(L, 2) == (lua_Integer)c.size() + 1 &&
+			append_element(L, c))
+		{
+			return 0;
+		}
+		return luaL_error(L, "index out of range");
+	}
+
+	static int inext(lua_State *L) {
+		lua_Integer i = lua_tointeger(L, 2) + 1;
+		auto &c = container_self<C>(L);
+		if ((size_t)i > c.size())
+			return 0;
+		lua_pushinteger(L, i);
+		push_sequence_element(L, c, i-1);
+		return 2;
+	}
+
+	static int pairs(lua_State *L) {
+		lua_pushcfunction(L, inext);
+		lua_pushvalue(L, 1);
+		lua_pushinteger(L, 0);
+		return 3;
+	}
+
+	static void set_extra(lua_State *L) {
+		lua_pushcfunction(L, pairs);
+		rawsetfield(L, -2, "__ipairs");
+	}
+};
+
+// std::map and std::unordered_map
+
+// The uservalue of a map proxy which had elements erased is a table marked
+// with this key, mapping each erased key to the key which followed it (false
+// for the last one). next() goes on from there when the previous key is gone.
+// pairs() starts with an empty table.
+struct ErasedKey {
+	static void *Key() { static int value; return &value; }
+};
+
+template <typename C>
+struct map_proxy {
+	using M = typename std::remove_const<C>::type;
+	using K = typename M::key_type;
+	using V = typename M::mapped_type;
+
+	// pushes the erased keys table of the proxy at 1, nil if there is none
+	static void push_erased(lua_State *L) {
+		_interlua_getuservalue(L, 1);
+		if (lua_istable(L, -1)) {
+			_interlua_rawgetp(L, -1, ErasedKey::Key());
+			const bool ours = lua_toboolean(L, -1);
+			lua_pop(L, 1);
+			if (ours)
+				return;
+		}
+		lua_pop(L, 1);
+		lua_pushnil(L);
+	}
+
+	static void new_erased(lua_State *L) {
+		lua_newtable(L);
+		lua_pushboolean(L, 1);
+		_interlua_rawsetp(L, -2, ErasedKey::Key());
+		lua_pushvalue(L, -1);
+		_interlua_setuservalue(L, 1);
+	}
+
+	static void erase(lua_State *L, M &c, typename M::iterator it) {
+		auto succ = std::next(it);
+		push_erased(L);
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			new_erased(L);
+		}
+		push_element<K>(L, it->first);
+		if (succ != c.end())
+			push_element<K>(L, succ->first);
+		else
+			lua_pushboolean(L, 0);
+		lua_rawset(L, -3);
+		lua_pop(L, 1);
+		c.erase(it);
+	}
+
+	static int index(lua_State *L) {
+		if (!arg_matches<Decay<K>>::test(L, 2))
+			return 0;
+		auto &c = container_self<C>(L);
+		auto it = c.find(get_element<K>(L, 2));
+		if (it == c.end())
+			return 0;
+		push_element_ref(L, it->second, 0);
+		return 1;
+	}
+
+	static int newindex(lua_State *L) {
+		auto &c = container_self<C>(L);
+		if (!arg_matches<Decay<K>>::test(L, 2))
+			return luaL_error(L, "wrong type of a key");
+		if (lua_isnil(L, 3)) {
+			auto it = c.find(get_element<K>(L, 2));
+			if (it != c.end())
+				erase(L, c, it);
+			return 0;
+		}
+		check_element<V>(L, 3);
+		auto key = get_element<K>(L, 2);
+		auto it = c.find(key);
+		if (it != c.end())
+			it->second = get_element<V>(L, 3);
+		else
+			c.emplace(std::move(key), get_element<V>(L, 3));
+		return 0;
+	}
+
+	// each step looks the previous key up, it's O(log n) for std::map
+	static int next(lua_State *L) {
+		auto &c = container_self<C>(L);
+		auto it = c.begin();
+		if (!lua_isnil(L, 2)) {
+			it = c.find(get_element<K>(L, 2));
+			if (it != c.end()) {
+				++it;
+			} else {
+				// erased during the traversal, go on from the first
+				// successor which is still there
+				push_erased(L);
+				if (lua_isnil(L, -1))
+					return luaL_error(L, "invalid key to 'next'");
+				lua_pushvalue(L, 2);
+				for (;;) {
+					lua_rawget(L, -2);
+					if (lua_isnil(L, -1))
+						return luaL_error(L, "invalid key to 'next'");
+					if (lua_type(L, -1) == LUA_TBOOLEAN)
+						return 0;
+					it = c.find(get_element<K>(L, -1));
+					if (it != c.end())
+						break;
+				}
+				lua_pop(L, 2);
+			}
+		}
+		if (it == c.end())
+			return 0;
+		push_element<K>(L, it->first);
+		push_element_ref(L, it->second, 0);
+		return 2;
+	}
+
+	static int pairs(lua_State *L) {
+		push_erased(L);
+		if (!lua_isnil(L, -1))
+			new_erased(L);
+		lua_pushcfunction(L, next);
+		lua_pushvalue(L, 1);
+		lua_pushnil(L);
+		return 3;
+	}
+
+	// no ipairs for maps
+	static void set_extra(lua_State*) {}
+};
+
+template <typename C>
+struct container_proxy;
+
+template <typename T, typename A>
+struct container_proxy<std::vector<T, A>> : sequence_proxy<std::vector<T, A>> {};
+template <typename T, typename A>
+struct container_proxy<const std::vector<T, A>> : sequence_proxy<const std::vector<T, A>> {};
+template <typename T, size_t N>
+struct container_proxy<std::array<T, N>> : sequence_proxy<std::array<T, N>> {};
+template <typename T, size_t N>
+struct container_proxy<const std::array<T, N>> : sequence_proxy<const std::array<T, N>> {};
+template <typename K, typename V, typename C, typename A>
+struct container_proxy<std::map<K, V, C, A>> : map_proxy<std::map<K, V, C, A>> {};
+template <typename K, typename V, typename C, typename A>
+struct container_proxy<const std::map<K, V, C, A>> : map_proxy<const std::map<K, V, C, A>> {};
+template <typename K, typename V, typename H, typename E, typename A>
+struct container_proxy<std::unordered_map<K, V, H, E, A>> :
+	map_proxy<std::unordered_map<K, V, H, E, A>> {};
+template <typename K, typename V, typename H, typename E, typename A>
+struct container_proxy<const std::unordered_map<K, V, H, E, A>> :
+	map_proxy<const std::unordered_map<K, V, H, E, A>> {};
+
+// The registry key of the metatable shared by all proxies of type C
+template <typename C>
+struct ContainerKey {
+	static void *Key() { static int value; return &value; }
+};
+
+template <typename P>
+static inline lua_CFunction proxy_newindex(std::false_type) { return P::newindex; }
+
+template <typename P>
+static inline lua_CFunction proxy_newindex(std::true_type) { return container_readonly; }
+
+template <typename C>
+static void push_container_metatable(lua_State *L) {
+	_interlua_rawgetp(L, LUA_REGISTRYINDEX, ContainerKey<C>::Key());
+	if (!lua_isnil(L, -1))
+		return;
+	lua_pop(L, 1);
+
+	using P = container_proxy<C>;
+	lua_createtable(L, 0, 5);
+	lua_pushcfunction(L, P::index);
+	rawsetfield(L, -2, "__index");
+	lua_pushcfunction(L, proxy_newindex<P>(std::is_const<C>()));
+	rawsetfield(L, -2, "__newindex");
+	lua_pushcfunction(L, container_len<C>);
+	rawsetfield(L, -2, "__len");
+	lua_pushcfunction(L, P::pairs);
+	rawsetfield(L, -2, "__pairs");
+	P::set_extra(L);
+	lua_pushvalue(L, -1);
+	_interlua_rawsetp(L, LUA_REGISTRYINDEX, ContainerKey<C>::Key());
+}
+
+// returns the container of the proxy at 'index', nullptr if it's not a proxy
+// of C
+template <typename C>
+static C *to_container(lua_State *L, int index) {
+	void *p = lua_touserdata(L, index);
+	if (!p || !lua_getmetatable(L, index))
+		return nullptr;
+	_interlua_rawgetp(L, LUA_REGISTRYINDEX, ContainerKey<C>::Key());
+	const bool ok = lua_rawequal(L, -1, -2);
+	lua_pop(L, 2);
+	return ok ? *(C**)p : nullptr;
+}
+
+template <typename C>
+struct StackOps<ContainerRef<C>> {
+	static inline int Push(lua_State *L, ContainerRef<C> r) {
+		*(C**)lua_newuserdata(L, sizeof(C*)) = r.Get();
+		push_container_metatable<C>(L);
+		lua_setmetatable(L, -2);
+		return 1;
+	}
+	static inline void Check(lua_State *L, int index, Error *err = &DefaultError) {
+		if (!to_container<C>(L, index))
+			argerror(L, index, "container proxy expected", err);
+	}
+	static inline ContainerRef<C> Get(lua_State *L, int index) {
+		return *to_container<C>(L, index);
+	}
+	static inline ContainerRef<C> LJGet(lua_State *L, int index) {
+		C *c = to_container<C>(L, index);
+		if (!c)
+			luaL_argerror(L, index, "container proxy expected");
+		return *c;
+	}
+};
+
+template <typename C>
+struct StackOps<const ContainerRef<C>&> : StackOps<ContainerRef<C>> {};
+
+template <typename C>
+struct arg_matches<ContainerRef<C>> {
+	static inline bool test(lua_State *L, int index) {
+		return to_container<C>(L, index) != nullptr;
+	}
+};
+
+template <typename C>
+struct arg_matches<const ContainerRef<C>&> : arg_matches<ContainerRef<C>> {};
+
+//============================================================================
+// Buffers
+//============================================================================
+
+// A view of a contiguous array. As an argument it's the memory of a Buffer,
+// valid for the duration of the call, nothing is copied.
+template <typename T>
+struct Span {
+	T *ptr = nullptr;
+	size_t len = 0;
+
+	Span() = default;
+	Span(T *ptr, size_t len): ptr(ptr), len(len) {}
+
+	T &operator[](size_t i) const { return ptr[i]; }
+	T *begin() const { return ptr; }
+	T *end() const { return ptr + len; }
+	size_t size() const { return len; }
+};
+
+// buffer elements start at a cache line boundary, the kernels below are
+// plain loops the compiler vectorizes
+constexpr size_t buffer_alignment = 64;
+
+template <typename T>
+struct buffer_header {
+	size_t len;
+	T *data;
+};
+
+// buffer_element<T> converts lua numbers into buffer elements and does the
+// element arithmetic. Integral elements go through lua_Integer and wrap
+// around: the arithmetic is done in an unsigned type at least as wide as
+// unsigned int, where overflow is defined.
+template <typename T, bool INTEGRAL = std::is_integral<T>::value>
+struct buffer_element;
+
+template <typename T>
+struct buffer_element<T, false> {
+	// doubles out of the range of T become infinities
+	static inline T from_number(lua_Number d) {
+		const lua_Number m = std::numeric_limits<T>::max();
+		if (d > m)
+			return std::numeric_limits<T>::infinity();
+		if (d < -m)
+			return -std::numeric_limits<T>::infinity();
+		return (T)d;
+	}
+	static inline T check(lua_State *L, int index) {
+		return from_number(luaL_checknumber(L, index));
+	}
+	static inline T add(T a, T b) { return a + b; }
+	static inline T mul(T a, T b) { return a * b; }
+};
+
+template <typename T>
+struct buffer_element<T, true> {
+	using wide_t = typename std::conditional<
+		(sizeof(T) < sizeof(unsigned)),
+		unsigned,
+		typename std::make_unsigned<T>::type
+	>::type;
+
+	static inline T from_integer(lua_Integer i) {
+		return (T)(wide_t)(uint64_t)i;
+	}
+	// non-integral results of scale() are truncated and wrapped modulo
+	// 2^64 first, NaN and infinities become 0
+	static inline T from_number(lua_Number d) {
+		if (!std::isfinite(d))
+			return 0;
+		d = std::fmod(std::trunc(d), 18446744073709551616.0);
+		const uint64_t u = d < 0 ? 0 - (uint64_t)-d : (uint64_t)d;
+		return (T)(wide_t)u;
+	}
+	// numbers have to fit lua_Integer
+	static inline T check(lua_State *L, int index) {
+#if LUA_VERSION_NUM >= 503
+		if (lua_isinteger(L, index))
+			return from_integer(lua_tointeger(L, index));
+#endif
+		const lua_Number d = luaL_checknumber(L, index);
+		const lua_Number lo = (lua_Number)std::numeric_limits<lua_Integer>::min();
+		if (!(d >= lo && d < -lo))
+			luaL_argerror(L, index, "number out of range");
+		return from_integer((lua_Integer)d);
+	}
+	static inline T add(T a, T b) { return (T)((wide_t)a + (wide_t)b); }
+	static inline T mul(T a, T b) { return (T)((wide_t)a * (wide_t)b); }
+};
+
+// The registry key of the metatable shared by all buffers of type T
+template <typename T>
+struct BufferKey {
+	static void *Key() { static int value; return &value; }
+};
+
+// Buffer<T> is a lua userdata holding a contiguous array of numbers (float,
+// double, int32_t and uint8_t are the intended ones). Scripts index it with
+// b[i], get its length with #b and run bulk operations in a single call:
+//
+//   b:fill(x)        b[i] = x
+//   b:add(x)         b[i] = b[i] + x, x is a number or a buffer of the same size
+//   b:mul(x)         b[i] = b[i] * x, x is a number or a buffer of the same size
+//   b:scale(s, [x])  b[i] = b[i] * s + x
+//   b:sum()          sum of the elements
+//   b:min(), b:max() the smallest/largest element, nil if the buffer is empty
+//   b:dot(x)         dot product with a buffer of the same size
+//
+// The mutating ones return the buffer. Integer buffers wrap around on
+// overflow, like unsigned C++ arithmetic, numbers stored into them have to
+// fit lua_Integer. Register Create under a name of your choice to let scripts
+// make buffers: Buffer(n) is zero-filled, Buffer{...} is filled from a table.
+template <typename T>
+class Buffer {
+	static_assert(std::is_arithmetic<T>::value, "buffers hold numbers");
+
+	using header = buffer_header<T>;
+	using element = buffer_element<T>;
+
+	// float sums lose less precision, integer sums are 64-bit and wrap
+	// around modulo 2^64
+	using acc_t = typename std::conditional<
+		std::is_floating_point<T>::value, double, uint64_t
+	>::type;
+	using result_t = typename std::conditional<
+		std::is_floating_point<T>::value, double, int64_t
+	>::type;
+
+	// the largest buffer whose allocation size doesn't overflow size_t
+	static constexpr size_t max_len =
+		(SIZE_MAX - sizeof(header) - buffer_alignment) / sizeof(T);
+
+	// integer buffers are scaled by a fraction too
+	using scalar_t = typename std::conditional<
+		std::is_floating_point<T>::value, T, double
+	>::type;
+
+	static Span<T> check(lua_State *L, int index) {
+		Span<T> s = To(L, index);
+		if (!s.ptr)
+			luaL_argerror(L, index, "buffer of the same type expected");
+		return s;
+	}
+
+	// the second argument is a buffer of the same size as 'a', or a number
+	static Span<T> check_other(lua_State *L, Span<T> a) {
+		Span<T> b = check(L, 2);
+		if (b.len != a.len)
+			luaL_argerror(L, 2, "buffer of the same size expected");
+		return b;
+	}
+
+	static int index(lua_State *L) {
+		if (lua_type(L, 2) == LUA_TNUMBER) {
+			Span<T> s = check(L, 1);
+			lua_Integer i = lua_tointeger(L, 2);
+			if (i < 1 || (size_t)i > s.len)
+				return 0;
+			StackOps<T>::Push(L, s.ptr[i-1]);
+			return 1;
+		}
+		lua_pushvalue(L, 2);
+		lua_rawget(L, lua_upvalueindex(1));
+		return 1;
+	}
+
+	static int newindex(lua_State *L) {
+		Span<T> s = check(L, 1);
+		lua_Integer i = luaL_checkinteger(L, 2);
+		if (i < 1 || (size_t)i > s.len)
+			return luaL_argerror(L, 2, "index out of range");
+		s.ptr[i-1] = element::check(L, 3);
+		return 0;
+	}
+
+	static int len(lua_State *L) {
+		lua_pushinteger(L, check(L, 1).len);
+		return 1;
+	}
+
+	static int fill(lua_State *L) {
+		Span<T> a = check(L, 1);
+		const T x = element::check(L, 2);
+		for (size_t i = 0; i < a.len; i++)
+			a.ptr[i] = x;
+		lua_settop(L, 1);
+		return 1;
+	}
+
+	static int add(lua_State *L) {
+		Span<T> a = check(L, 1);
+		if (lua_type(L, 2) == LUA_TNUMBER) {
+			const T x = element::check(L, 2);
+			for (size_t i = 0; i < a.len; i++)
+				a.ptr[i] = element::add(a.ptr[i], x);
+		} else {
+			Span<T> b = check_other(L, a);
+			for (size_t i = 0; i < a.len; i++)
+				a.ptr[i] = element::add(a.ptr[i], b.ptr[i]);
+		}
+		lua_settop(L, 1);
+		return 1;
+	}
+
+	static int mul(lua_State *L) {
+		Span<T> a = check(L, 1);
+		if (lua_type(L, 2) == LUA_TNUMBER) {
+			const T x = element::check(L, 2);
+			for (size_t i = 0; i < a.len; i++)
+				a.ptr[i] = element::mul(a.ptr[i], x);
+		} else {
+			Span<T> b = check_other(L, a);
+			for (size_t i = 0; i < a.len; i++)
+				a.ptr[i] = element::mul(a.ptr[i], b.ptr[i]);
+		}
+		lua_settop(L, 1);
+		return 1;
+	}
+
+	static int scale(lua_State *L) {
+		Span<T> a = check(L, 1);
+		const scalar_t s = (scalar_t)luaL_checknumber(L, 2);
+		const scalar_t x = (scalar_t)luaL_optnumber(L, 3, 0);
+		for (size_t i = 0; i < a.len; i++)
+			a.ptr[i] = element::from_number(a.ptr[i] * s + x);
+		lua_settop(L, 1);
+		return 1;
+	}
+
+	// reductions keep 4 independent accumulators, the additions don't
+	// wait for each other
+	static int sum(lua_State *L) {
+		Span<T> a = check(L, 1);
+		acc_t acc[4] = {0, 0, 0, 0};
+		size_t i = 0;
+		for (; i + 4 <= a.len; i += 4) {
+			for (int j = 0; j < 4; j++)
+				acc[j] += (acc_t)a.ptr[i+j];
+		}
+		for (; i < a.len; i++)
+			acc[0] += (acc_t)a.ptr[i];
+		StackOps<result_t>::Push(L, (result_t)((acc[0] + acc[1]) + (acc[2] + acc[3])));
+		return 1;
+	}
+
+	static int dot(lua_State *L) {
+		Span<T> a = check(L, 1);
+		Span<T> b = check_other(L, a);
+		acc_t acc[4] = {0, 0, 0, 0};
+		size_t i = 0;
+		for (; i + 4 <= a.len; i += 4) {
+			for (int j = 0; j < 4; j++)
+				acc[j] += (acc_t)a.ptr[i+j] * (acc_t)b.ptr[i+j];
+		}
+		for (; i < a.len; i++)
+			acc[0] += (acc_t)a.ptr[i] * (acc_t)b.ptr[i];
+		StackOps<result_t>::Push(L, (result_t)((acc[0] + acc[1]) + (acc[2] + acc[3])));
+		return 1;
+	}
+
+	static int min(lua_State *L) {
+		Span<T> a = check(L, 1);
+		if (a.len == 0)
+			return 0;
+		T m = a.ptr[0];
+		for (size_t i = 1; i < a.len; i++)
+			m = a.ptr[i] < m ? a.ptr[i] : m;
+		StackOps<T>::Push(L, m);
+		return 1;
+	}
+
+	static int max(lua_State *L) {
+		Span<T> a = check(L, 1);
+		if (a.len == 0)
+			return 0;
+		T m = a.ptr[0];
+		for (size_t i = 1; i < a.len; i++)
+			m = a.ptr[i] > m ? a.ptr[i] : m;
+		StackOps<T>::Push(L, m);
+		return 1;
+	}
+
+	static void push_metatable(lua_State *L) {
+		_interlua_rawgetp(L, LUA_REGISTRYINDEX, BufferKey<T>::Key());
+		if (!lua_isnil(L, -1))
+			return;
+		lua_pop(L, 1);
+
+		static const luaL_Reg methods[] = {
+			{"fill", fill},
+			{"add", add},
+			{"mul", mul},
+			{"scale", scale},
+			{"sum", sum},
+			{"dot", dot},
+			{"min", min},
+			{"max", max},
+		};
+		lua_createtable(L, 0, 3);
+		lua_createtable(L, 0, sizeof(methods) / sizeof(methods[0]));
+		for (const luaL_Reg &m : methods) {
+			lua_pushcfunction(L, m.func);
+			rawsetfield(L, -2, m.name);
+		}
+		lua_pushcclosure(L, index, 1);
+		rawsetfield(L, -2, "__index");
+		lua_pushcfunction(L, newindex);
+		rawsetfield(L, -2, "__newindex");
+		lua_pushcfunction(L, len);
+		rawsetfield(L, -2, "__len");
+		lua_pushvalue(L, -1);
+		_interlua_rawsetp(L, LUA_REGISTRYINDEX, BufferKey<T>::Key());
+	}
+
+public:
+	// pushes a new zero-filled buffer of 'n' elements, returns its memory,
+	// raises a lua error if 'n' is too large to allocate
+	static Span<T> Push(lua_State *L, size_t n) {
+		if (n > max_len)
+			luaL_argerror(L, 1, "buffer too large");
+		void *mem = lua_newuserdata(L,
+			sizeof(header) + buffer_alignment - 1 + n * sizeof(T));
+		auto h = static_cast<header*>(mem);
+		uintptr_t data = (uintptr_t)(h + 1);
+		data = (data + buffer_alignment - 1) & ~(uintptr_t)(buffer_alignment - 1);
+		h->len = n;
+		h->data = (T*)data;
+		memset(h->data, 0, n * sizeof(T));
+		push_metatable(L);
+		lua_setmetatable(L, -2);
+		return {h->data, n};
+	}
+
+	// returns the memory of the buffer at 'index', an empty Span if it's not
+	// a buffer of T
+	static Span<T> To(lua_State *L, int index) {
+		auto h = static_cast<header*>(lua_touserdata(L, index));
+		if (!h || !lua_getmetatable(L, index))
+			return {};
+		_interlua_rawgetp(L, LUA_REGISTRYINDEX, BufferKey<T>::Key());
+		const bool ok = lua_rawequal(L, -1, -2);
+		lua_pop(L, 2);
+		return ok ? Span<T>{h->data, h->len} : Span<T>{};
+	}
+
+	// lua_CFunction making a buffer of the given size or from a table
+	static int Create(lua_State *L) {
+		if (lua_type(L, 1) == LUA_TTABLE) {
+			const size_t n = _interlua_rawlen(L, 1);
+			Span<T> s = Push(L, n);
+			for (size_t i = 0; i < n; i++) {
+				lua_rawgeti(L, 1, i+1);
+				s.ptr[i] = element::from_number(lua_tonumber(L, -1));
+				lua_pop(L, 1);
+			}
+			return 1;
+		}
+		lua_Integer n = luaL_checkinteger(L, 1);
+		if (n < 0)
+			return luaL_argerror(L, 1, "negative size");
+		if ((uint64_t)n > max_len)
+			return luaL_argerror(L, 1, "buffer too large");
+		Push(L, n);
+		return 1;
+	}
+};
+
+// Spans are pushed as new buffers (a copy), they are taken from buffers
+// without copying. Span<const T> takes a buffer of T.
+template <typename T>
+struct StackOps<Span<T>> {
+	using PURE_T = typename std::remove_const<T>::type;
+	static inline int Push(lua_State *L, Span<T> s) {
+		Span<PURE_T> b = Buffer<PURE_T>::Push(L, s.len);
+		if (s.len)
+			memcpy(b.ptr, s.ptr, s.len * sizeof(T));
+		return 1;
+	}
+	static inline void Check(lua_State *L, int index, Error *err = &DefaultError) {
+		if (!Buffer<PURE_T>::To(L, index).ptr)
+			argerror(L, index, "buffer expected", err);
+	}
+	static inline Span<T> Get(lua_State *L, int index) {
+		Span<PURE_T> b = Buffer<PURE_T>::To(L, index);
+		return {b.ptr, b.len};
+	}
+	static inline Span<T> LJGet(lua_State *L, int index) {
+		Span<PURE_T> b = Buffer<PURE_T>::To(L, index);
+		if (!b.ptr)
+			luaL_argerror(L, index, "buffer expected");
+		return {b.ptr, b.len};
+	}
+};
+
+template <typename T>
+struct StackOps<const Span<T>&> : StackOps<Span<T>> {};
+
+template <typename T>
+struct arg_matches<Span<T>> {
+	static inline bool test(lua_State *L, int index) {
+		using PURE_T = typename std::remove_const<T>::type;
+		return Buffer<PURE_T>::To(L, index).ptr != nullptr;
+	}
+};
 
 } // namespace InterLua
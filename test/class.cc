@@ -337,3 +337,424 @@ STF_TEST("methods") {
 	STF_ASSERT(lua_gettop(L) == 0);
 	END();
 }
+
+STF_TEST("compile-time bound methods") {
+	LUA();
+	InterLua::GlobalNamespace(L).
+		Class<Storage>("Storage").
+			Constructor().
+			Function<INTERLUA_FP(&Storage::store_int)>("store_int").
+			Function<INTERLUA_FP(&Storage::store_float)>("store_float").
+			Function<INTERLUA_FP(&Storage::store_double)>("store_double").
+			Function<INTERLUA_FP(&Storage::get_int)>("get_int").
+			Function<INTERLUA_FP(&Storage::get_float)>("get_float").
+			Function<INTERLUA_FP(&Storage::get_double)>("get_double").
+		End().
+		Function<INTERLUA_FP(Examine)>("examine").
+	End();
+	const char *init = R"*****(
+		s = Storage()
+		s:store_int(7)
+		s:store_float(7)
+		s:store_double(7)
+		s:store_int(s:get_int() - 2)
+		s:store_float(s:get_float() - 1)
+		s:store_double(s:get_double() - 0)
+		ok = examine(s)
+	)*****";
+	DO(init);
+	{
+		bool ok = InterLua::Global(L, "ok");
+		STF_ASSERT(ok);
+	}
+	STF_ASSERT(lua_gettop(L) == 0);
+	END();
+}
+
+STF_TEST("trusted methods") {
+	LUA();
+	InterLua::GlobalNamespace(L).
+		Class<Storage>("Storage").Trusted().
+			Constructor().
+			Function("store_int", &Storage::store_int).
+			Function("store_float", &Storage::store_float).
+			Function("store_double", &Storage::store_double).
+			Function("get_int", &Storage::get_int).
+			Function<INTERLUA_FP(&Storage::get_float)>("get_float").
+			Function<INTERLUA_FP(&Storage::get_double)>("get_double").
+			StaticFunction("examine", Examine).
+		End().
+	End();
+	const char *init = R"*****(
+		s = Storage()
+		s:store_int(7)
+		s:store_float(7)
+		s:store_double(7)
+		s:store_int(s:get_int() - 2)
+		s:store_float(s:get_float() - 1)
+		s:store_double(s:get_double() - 0)
+		ok = Storage.examine(s)
+	)*****";
+	DO(init);
+	{
+		bool ok = InterLua::Global(L, "ok");
+		STF_ASSERT(ok);
+	}
+	STF_ASSERT(lua_gettop(L) == 0);
+	END();
+}
+
+struct Node {
+	Node *child = nullptr;
+	int value = 0;
+
+	Node *get_child() { return child; }
+	const Node *get_const_child() const { return child; }
+	int get_value() const { return value; }
+};
+
+struct Leaf : Node {};
+
+STF_TEST("pointer cache") {
+	LUA();
+	InterLua::GlobalNamespace(L).
+		Class<Node>("Node").
+			CachePointers().
+			Function("get_child", &Node::get_child).
+			Function("get_const_child", &Node::get_const_child).
+			Function("get_value", &Node::get_value).
+		End().
+		DerivedClass<Leaf, Node>("Leaf").
+		End().
+	End();
+
+	Node root, child;
+	Leaf leaf;
+	root.child = &child;
+	child.value = 5;
+	InterLua::StackOps<Node*>::Push(L, &root);
+	lua_setglobal(L, "root");
+	InterLua::StackOps<Leaf*>::Push(L, &leaf);
+	lua_setglobal(L, "leaf");
+	InterLua::StackOps<Leaf*>::Push(L, &leaf);
+	lua_setglobal(L, "leaf2");
+	const char *code = R"*****(
+		local a, b = root:get_child(), root:get_child()
+		assert(a == b and a:get_value() == 5)
+		local c = root:get_const_child()
+		assert(c ~= a and c == root:get_const_child())
+		assert(leaf == leaf2)
+		child = a
+	)*****";
+	DO(code);
+
+	InterLua::Evict(L, &child);
+	DO("assert(root:get_child() ~= child)");
+	STF_ASSERT(lua_gettop(L) == 0);
+	END();
+}
+
+struct Heavy {
+	static int copies;
+	int data[64];
+
+	Heavy(int v) { for (auto &d : data) d = v; }
+	Heavy(const Heavy &r) { copies++; for (int i = 0; i < 64; i++) data[i] = r.data[i]; }
+	Heavy(Heavy &&r) { copies++; for (int i = 0; i < 64; i++) data[i] = r.data[i]; }
+
+	static Heavy make(int v) { return Heavy(v); }
+	Heavy doubled() const { return Heavy(data[0] * 2); }
+	int get() const { return data[63]; }
+
+	// the stack size seen by a function taking lua_State*
+	static Heavy top(lua_State *L) { return Heavy(lua_gettop(L)); }
+	Heavy self_top(lua_State *L) const { return Heavy(lua_gettop(L)); }
+};
+
+int Heavy::copies = 0;
+
+STF_TEST("values constructed in place") {
+	LUA();
+	InterLua::GlobalNamespace(L).
+		Class<Heavy>("Heavy").
+			Constructor<int>().
+			StaticFunction("make", &Heavy::make).
+			Function("doubled", &Heavy::doubled).
+			Function<INTERLUA_FP(&Heavy::doubled)>("direct_doubled").
+			Function("get", &Heavy::get).
+			StaticFunction("top", &Heavy::top).
+			Function("self_top", &Heavy::self_top).
+			Function<INTERLUA_FP(&Heavy::self_top)>("direct_self_top").
+		End().
+	End();
+
+	Heavy &e = InterLua::Emplace<Heavy>(L, 5);
+	STF_ASSERT(e.get() == 5);
+	lua_setglobal(L, "e");
+	const char *code = R"*****(
+		local h = Heavy.make(3)
+		assert(h:get() == 3)
+		assert(h:doubled():get() == 6)
+		assert(h:direct_doubled():doubled():get() == 12)
+		assert(Heavy(7):get() == 7 and e:get() == 5)
+	)*****";
+	DO(code);
+	STF_ASSERT(Heavy::copies == 0);
+
+	// the result of a function taking lua_State* is pushed after the call
+	const char *state_code = R"*****(
+		assert(Heavy.top():get() == 0)
+		assert(e:self_top():get() == 1)
+		assert(e:direct_self_top():get() == 1)
+	)*****";
+	DO(state_code);
+	STF_ASSERT(lua_gettop(L) == 0);
+	END();
+}
+
+struct Later {
+	int v;
+
+	Later(int v): v(v) {}
+	int get() const { return v; }
+};
+
+static Later later_value(int v) { return Later(v); }
+static Later later_length(const char *s) { return Later(strlen(s)); }
+static Later *later_pointer() { static Later l(7); return &l; }
+static const Later *later_const_pointer() { return later_pointer(); }
+
+STF_TEST("returning classes registered after the function") {
+	LUA();
+	InterLua::GlobalNamespace(L).
+		Function("value", later_value).
+		Function<INTERLUA_FP(later_value)>("direct_value").
+		Function("overloaded", later_value, later_length).
+		Function("pointer", later_pointer).
+		Function("const_pointer", later_const_pointer).
+		Function("functor", [](int v) { return Later(v * 2); }).
+		Class<Later>("Later").
+			Function("get", &Later::get).
+		End().
+	End();
+	const char *code = R"*****(
+		assert(value(1):get() == 1 and direct_value(2):get() == 2)
+		assert(overloaded(3):get() == 3 and overloaded("abcd"):get() == 4)
+		assert(pointer():get() == 7 and functor(4):get() == 8)
+		assert(getmetatable(const_pointer()) == getmetatable(pointer()).__const)
+	)*****";
+	DO(code);
+	STF_ASSERT(lua_gettop(L) == 0);
+	END();
+}
+
+struct Animal {
+	int legs() const { return 4; }
+	const char *name() const { return "animal"; }
+	const char *sound() const { return "..."; }
+};
+
+struct Bird : Animal {
+	int legs() const { return 2; }
+};
+
+struct Parrot : Bird {
+	const char *name() const { return "parrot"; }
+};
+
+STF_TEST("inherited methods after reopening") {
+	LUA();
+	InterLua::GlobalNamespace(L).
+		Class<Animal>("Animal").
+			Constructor().
+			Function("legs", &Animal::legs).
+			Function("name", &Animal::name).
+		End().
+		DerivedClass<Bird, Animal>("Bird").
+			Constructor().
+			Function("legs", &Bird::legs).
+		End().
+		DerivedClass<Parrot, Bird>("Parrot").
+			Constructor().
+			Function("name", &Parrot::name).
+		End().
+	End();
+	DO("assert(Parrot():legs() == 2 and Parrot():name() == 'parrot')");
+	DO("assert(Parrot().sound == nil)");
+
+	// reopen the base class, derived classes see the new method, but keep
+	// their overrides
+	InterLua::GlobalNamespace(L).
+		Class<Animal>("Animal").
+			Function("sound", &Animal::sound).
+			Function("legs", &Animal::legs).
+		End().
+	End();
+	const char *code = R"*****(
+		local p = Parrot()
+		assert(p:sound() == "..." and p:legs() == 2 and p:name() == "parrot")
+		assert(Bird():legs() == 2 and Bird():name() == "animal")
+		assert(Animal():legs() == 4)
+	)*****";
+	DO(code);
+	STF_ASSERT(lua_gettop(L) == 0);
+	END();
+}
+
+struct Vec2 {
+	double x = 0.0, y = 0.0;
+
+	Vec2() {}
+	Vec2(double x, double y): x(x), y(y) {}
+	Vec2 operator+(const Vec2 &r) const { return {x + r.x, y + r.y}; }
+	Vec2 operator-() const { return {-x, -y}; }
+	bool operator==(const Vec2 &r) const { return x == r.x && y == r.y; }
+	bool operator<(const Vec2 &r) const { return x < r.x && y < r.y; }
+	bool operator<=(const Vec2 &r) const { return x <= r.x && y <= r.y; }
+	double operator()(double s) const { return (x + y) * s; }
+	int size() const { return 2; }
+	const char *to_string() const { return "Vec2"; }
+	double get_x() const { return x; }
+	double get_y() const { return y; }
+};
+
+Vec2 operator*(const Vec2 &v, double s) { return {v.x * s, v.y * s}; }
+
+struct Vec2Ex : Vec2 {
+	Vec2Ex() {}
+};
+
+template <int N>
+struct Deep : Deep<N-1> {};
+
+template <>
+struct Deep<0> {
+	int base() { return 0; }
+	int added() { return 1; }
+};
+
+template <int N>
+struct register_deep {
+	static void reg(lua_State *L) {
+		register_deep<N-1>::reg(L);
+		char name[16];
+		snprintf(name, sizeof(name), "Deep%d", N);
+		InterLua::GlobalNamespace(L).
+			DerivedClass<Deep<N>, Deep<N-1>>(name).Constructor().End().
+		End();
+	}
+};
+
+template <>
+struct register_deep<0> {
+	static void reg(lua_State *L) {
+		InterLua::GlobalNamespace(L).
+			Class<Deep<0>>("Deep0").
+				Constructor().
+				Function("base", &Deep<0>::base).
+			End().
+		End();
+	}
+};
+
+// reopens the base from a lua_CFunction, which is guaranteed only
+// LUA_MINSTACK slots, flattening goes through 40 levels of derived classes
+static int reopen_deep(lua_State *L) {
+	InterLua::GlobalNamespace(L).
+		Class<Deep<0>>("Deep0").
+			Function("added", &Deep<0>::added).
+		End().
+	End();
+	return 0;
+}
+
+STF_TEST("reopening a deep hierarchy") {
+	LUA();
+	register_deep<40>::reg(L);
+	lua_pushcfunction(L, reopen_deep);
+	lua_setglobal(L, "reopen_deep");
+	DO("reopen_deep()");
+	DO("assert(Deep40():base() == 0 and Deep40():added() == 1)");
+	STF_ASSERT(lua_gettop(L) == 0);
+	END();
+}
+
+STF_TEST("operators") {
+	LUA();
+	InterLua::GlobalNamespace(L).
+		Class<Vec2>("Vec2").
+			Constructor<double, double>().
+			Operator("__add", &Vec2::operator+).
+			Operator<INTERLUA_FP(&Vec2::operator-)>("__unm").
+			Operator("__mul", (Vec2 (*)(const Vec2&, double))operator*).
+			Operator("__eq", &Vec2::operator==).
+			Operator("__lt", &Vec2::operator<).
+			Operator("__le", &Vec2::operator<=).
+			Operator("__call", &Vec2::operator()).
+			Operator("__len", &Vec2::size).
+			Operator("__tostring", &Vec2::to_string).
+			Function("x", &Vec2::get_x).
+			Function("y", &Vec2::get_y).
+		End().
+		DerivedClass<Vec2Ex, Vec2>("Vec2Ex").
+			Constructor().
+		End().
+	End();
+	const char *code = R"*****(
+		local a, b = Vec2(1, 2), Vec2(3, 4)
+		local c = a + b
+		assert(c:x() == 4 and c:y() == 6)
+		local d = -(a * 2)
+		assert(d:x() == -2 and d:y() == -4)
+		assert(a + b == Vec2(4, 6) and a ~= b)
+		assert(a < b and a <= b and not (b < a))
+		assert(a(10) == 30)
+		assert(#a == 2 and tostring(a) == "Vec2")
+
+		local e = Vec2Ex()
+		assert(e == Vec2(0, 0) and (e + a):x() == 1 and tostring(e) == "Vec2")
+	)*****";
+	DO(code);
+	STF_ASSERT(lua_gettop(L) == 0);
+	END();
+}
+
+struct Counter {
+	int n = 0;
+
+	Counter() {}
+	void add() { n++; }
+	void add_n(int v) { n += v; }
+	void add_counter(const Counter &c) { n += c.n; }
+	int get() const { return n; }
+	const Counter *as_const() const { return this; }
+};
+
+STF_TEST("overloaded methods") {
+	LUA();
+	InterLua::GlobalNamespace(L).
+		Class<Counter>("Counter").
+			Constructor().
+			Function("add", &Counter::add, &Counter::add_n, &Counter::add_counter).
+			Function("get", &Counter::get).
+			Function("as_const", &Counter::as_const).
+		End().
+	End();
+	const char *code = R"*****(
+		local a, b = Counter(), Counter()
+		a:add()
+		a:add(5)
+		b:add(2)
+		a:add(b)
+		a:add(b:as_const())
+		assert(a:get() == 10)
+		ok = pcall(function() b:as_const():add(1) end)
+	)*****";
+	DO(code);
+	{
+		bool ok = InterLua::Global(L, "ok");
+		STF_ASSERT(!ok);
+	}
+	STF_ASSERT(lua_gettop(L) == 0);
+	END();
+}
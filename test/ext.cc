@@ -18,5 +18,337 @@ STF_TEST("tuple") {
 		assert(a == 7 and b == 42);
 	)*****";
 	DO(init);
+	{
+		// StackRef adjusts multiple values and no values to one
+		auto t = InterLua::StackRef::NewTable(L);
+		t.Set("a", std::make_tuple(1, 2));
+		t.Set("b", std::make_tuple());
+		STF_ASSERT(t["a"] == 1 && t["b"].IsNil());
+	}
+	STF_ASSERT(lua_gettop(L) == 0);
+	END();
+}
+
+static int tuple_sum(std::tuple<int, double, std::string> t, std::pair<int, int> p) {
+	return std::get<0>(t) + (int)std::get<1>(t) + (int)std::get<2>(t).size() +
+		p.first + p.second;
+}
+
+static std::pair<int, const char*> pair_foo() {
+	return {1, "one"};
+}
+
+STF_TEST("tuple arguments and results") {
+	LUA();
+	InterLua::GlobalNamespace(L).
+		Function("tuple_sum", &tuple_sum).
+		Function("pair_foo", &pair_foo).
+	End();
+	const char *init = R"*****(
+		assert(tuple_sum({1, 2.5, "abc"}, {10, 20}) == 36)
+		assert(not pcall(tuple_sum, {1, 2.5}, {10, 20}))
+		assert(not pcall(tuple_sum, {1, 2.5, "abc"}, {10, {}}))
+		local n, s = pair_foo()
+		assert(n == 1 and s == "one")
+		function divmod(a, b)
+			return math.floor(a / b), a % b
+		end
+		function words()
+			return "hello", "world"
+		end
+		function nothing()
+		end
+	)*****";
+	DO(init);
+	{
+		auto divmod = InterLua::Global(L, "divmod");
+		auto t = divmod.Call<std::tuple<int, int>>(17, 5);
+		STF_ASSERT(std::get<0>(t) == 3 && std::get<1>(t) == 2);
+
+		InterLua::LuaFunction<std::pair<std::string, std::string> ()> words(L, "words");
+		auto p = words();
+		STF_ASSERT(p.first == "hello" && p.second == "world");
+
+		InterLua::Error err(InterLua::Quiet);
+		InterLua::LuaFunction<std::tuple<int, int> ()> nothing(L, "nothing");
+		nothing.Call(&err);
+		STF_ASSERT(err);
+
+		InterLua::Global(L, "nothing").Call<void>();
+		STF_ASSERT(lua_gettop(L) == 0);
+	}
+	END();
+}
+
+std::string string_join(const std::string &a, std::string b) {
+	return a + b;
+}
+
+size_t string_size(const std::string &s) {
+	return s.size();
+}
+
+STF_TEST("std::string") {
+	LUA();
+	InterLua::GlobalNamespace(L).
+		Function("join", &string_join).
+		Function("size", &string_size).
+	End();
+	const char *init = R"*****(
+		assert(join("foo", "bar") == "foobar")
+		local s = join("a\0b", "\0")
+		assert(#s == 4 and size(s) == 4)
+		assert(not pcall(join, "a", {}))
+	)*****";
+	DO(init);
+	std::string s = InterLua::Global(L, "_VERSION");
+	STF_ASSERT(s.compare(0, 4, "Lua ") == 0);
+	STF_ASSERT(lua_gettop(L) == 0);
+	END();
+}
+
+double vector_sum(const std::vector<double> &v) {
+	double sum = 0;
+	for (double n : v)
+		sum += n;
+	return sum;
+}
+
+std::vector<std::string> vector_split(const std::string &s) {
+	std::vector<std::string> out;
+	size_t b = 0;
+	for (size_t e; (e = s.find(',', b)) != std::string::npos; b = e + 1)
+		out.push_back(s.substr(b, e - b));
+	out.push_back(s.substr(b));
+	return out;
+}
+
+std::array<int, 3> array_reverse(std::array<int, 3> a) {
+	return {{a[2], a[1], a[0]}};
+}
+
+std::map<std::string, int> map_count(const std::vector<std::string> &words) {
+	std::map<std::string, int> out;
+	for (const auto &w : words)
+		out[w]++;
+	return out;
+}
+
+int umap_get(const std::unordered_map<int, std::vector<int>> &m, int k) {
+	auto it = m.find(k);
+	return it == m.end() ? -1 : (int)it->second.size();
+}
+
+STF_TEST("containers") {
+	LUA();
+	InterLua::GlobalNamespace(L).
+		Function("sum", &vector_sum).
+		Function("split", &vector_split).
+		Function("reverse", &array_reverse).
+		Function("count", &map_count).
+		Function("get", &umap_get).
+	End();
+	const char *init = R"*****(
+		assert(sum({}) == 0)
+		assert(sum({1, 2, 3.5}) == 6.5)
+		assert(not pcall(sum, {1, "x"}))
+		assert(not pcall(sum, 5))
+
+		local t = split("a,b,,c")
+		assert(#t == 4 and t[1] == "a" and t[3] == "" and t[4] == "c")
+
+		local r = reverse({1, 2, 3})
+		assert(#r == 3 and r[1] == 3 and r[3] == 1)
+		assert(not pcall(reverse, {1, 2}))
+
+		local c = count({"x", "y", "x"})
+		assert(c.x == 2 and c.y == 1)
+
+		assert(get({[7] = {1, 2}}, 7) == 2)
+		assert(get({[7] = {1, 2}}, 8) == -1)
+		assert(not pcall(get, {[7] = {1, "2"}}, 7))
+	)*****";
+	DO(init);
+	DO("v = {10, 20, 30}");
+	auto v = InterLua::Global(L, "v").As<std::vector<int>>();
+	STF_ASSERT(v.size() == 3 && v[2] == 30);
+	STF_ASSERT(lua_gettop(L) == 0);
+	END();
+}
+
+struct Item {
+	int n = 0;
+};
+
+STF_TEST("container proxies") {
+	LUA();
+	std::vector<double> v = {1, 2, 3};
+	const std::vector<double> cv = {4, 5};
+	std::array<Item, 2> items;
+	std::map<std::string, int> m = {{"a", 1}, {"b", 2}};
+	std::map<int, int> erased = {{1, 1}, {2, 2}, {3, 3}, {4, 4}, {5, 5}};
+	std::unordered_map<int, int> uerased = {{1, 1}, {2, 2}, {3, 3}, {4, 4}};
+	std::vector<bool> bits = {true, false};
+	InterLua::GlobalNamespace(L).
+		Class<Item>("Item").
+			Variable("n", &Item::n).
+		End().
+	End();
+	InterLua::StackOps<InterLua::ContainerRef<std::vector<double>>>::Push(L, v);
+	lua_setglobal(L, "v");
+	InterLua::StackOps<InterLua::ContainerRef<const std::vector<double>>>::Push(L, cv);
+	lua_setglobal(L, "cv");
+	InterLua::StackOps<InterLua::ContainerRef<std::array<Item, 2>>>::Push(L, items);
+	lua_setglobal(L, "items");
+	InterLua::StackOps<InterLua::ContainerRef<std::map<std::string, int>>>::Push(L, m);
+	lua_setglobal(L, "m");
+	InterLua::StackOps<InterLua::ContainerRef<std::map<int, int>>>::Push(L, erased);
+	lua_setglobal(L, "erased");
+	InterLua::StackOps<InterLua::ContainerRef<std::unordered_map<int, int>>>::Push(L, uerased);
+	lua_setglobal(L, "uerased");
+	InterLua::StackOps<InterLua::ContainerRef<std::vector<bool>>>::Push(L, bits);
+	lua_setglobal(L, "bits");
+
+	const char *init = R"*****(
+		assert(#v == 3 and v[1] == 1 and v[3] == 3 and v[4] == nil)
+		v[2] = 20
+		v[#v+1] = 4
+		assert(not pcall(function() v[10] = 1 end))
+		assert(not pcall(function() v[1] = "x" end))
+
+		assert(#cv == 2 and cv[2] == 5)
+		assert(not pcall(function() cv[1] = 1 end))
+
+		items[2]:n(7)
+		assert(items[2]:n() == 7)
+
+		assert(m.a == 1 and m.c == nil)
+		m.c = 3
+		m.a = nil
+
+		assert(bits[1] == true and bits[2] == false)
+		bits[2] = true
+		bits[3] = false
+		assert(#bits == 3 and bits[2] == true)
+
+		-- erasing during a traversal, __pairs is called directly for 5.1
+		local function erase_some(m, n)
+			local seen = 0
+			for k, v in getmetatable(m).__pairs(m) do
+				seen = seen + 1
+				if v % 2 == 0 or v == 3 then m[k] = nil end
+				if v == 3 then m[k+1] = nil end
+			end
+			return seen
+		end
+		assert(erase_some(erased) == 4)
+		assert(erased[1] == 1 and erased[2] == nil and erased[5] == 5)
+		erase_some(uerased)
+		assert(uerased[1] == 1 and uerased[2] == nil and uerased[3] == nil)
+	)*****";
+	DO(init);
+	STF_ASSERT(bits.size() == 3 && bits[1]);
+	STF_ASSERT(erased.size() == 2 && uerased.size() == 1);
+	STF_ASSERT(v.size() == 4 && v[1] == 20 && v[3] == 4);
+	STF_ASSERT(items[1].n == 7);
+	STF_ASSERT(m.size() == 2 && m.count("c") == 1 && m.count("a") == 0);
+
+#if LUA_VERSION_NUM >= 502
+	DO(R"(
+		local sum = 0
+		for i, x in ipairs(v) do sum = sum + i * x end
+		assert(sum == 1 + 40 + 9 + 16)
+		local keys = ""
+		for k, x in pairs(m) do keys = keys .. k .. x end
+		assert(keys == "b2c3")
+	)");
+#endif
+	STF_ASSERT(lua_gettop(L) == 0);
+	END();
+}
+
+static float span_sum(InterLua::Span<const float> s) {
+	float sum = 0;
+	for (float x : s)
+		sum += x;
+	return sum;
+}
+
+static void span_negate(InterLua::Span<float> s) {
+	for (float &x : s)
+		x = -x;
+}
+
+STF_TEST("buffers") {
+	LUA();
+	InterLua::GlobalNamespace(L).
+		CFunction("FloatBuffer", InterLua::Buffer<float>::Create).
+		CFunction("DoubleBuffer", InterLua::Buffer<double>::Create).
+		CFunction("IntBuffer", InterLua::Buffer<int32_t>::Create).
+		CFunction("ByteBuffer", InterLua::Buffer<uint8_t>::Create).
+		Function("span_sum", span_sum).
+		Function("span_negate", span_negate).
+	End();
+	const char *init = R"*****(
+		local f = FloatBuffer(5)
+		assert(#f == 5 and f[1] == 0 and f[6] == nil)
+		f[2] = 1.5
+		assert(f[2] == 1.5)
+		assert(not pcall(function() f[6] = 1 end))
+
+		f:fill(2):add(1):mul(2)
+		assert(f[5] == 6 and f:sum() == 30)
+		f:scale(0.5, 1)
+		assert(f[1] == 4)
+
+		local g = FloatBuffer{1, 2, 3, 4, 5}
+		assert(f:dot(g) == 60)
+		f:add(g)
+		assert(f[5] == 9 and f:min() == 5 and f:max() == 9)
+		assert(not pcall(f.add, f, FloatBuffer(2)))
+		assert(not pcall(f.add, f, DoubleBuffer(5)))
+		assert(FloatBuffer(0):min() == nil)
+
+		assert(span_sum(g) == 15)
+		span_negate(g)
+		assert(g[1] == -1 and g:sum() == -15)
+		assert(not pcall(span_sum, {1, 2}))
+
+		local i = IntBuffer{1, 2, 3}
+		i:scale(0.5)
+		assert(i[1] == 0 and i[3] == 1)
+		assert(IntBuffer{2147483647, 1}:sum() == 2147483648)
+
+		local b = ByteBuffer{250}
+		b:add(10)
+		assert(b[1] == 4)
+		b:fill(16):mul(16)
+		assert(b[1] == 0)
+
+		local w = IntBuffer{2147483647, -2147483648}
+		w:add(1)
+		assert(w[1] == -2147483648 and w[2] == -2147483647)
+		w:mul(IntBuffer{2, 2})
+		assert(w[1] == 0 and w[2] == 2)
+		w:fill(-1)
+		assert(w[1] == -1 and w:sum() == -2)
+		assert(not pcall(w.fill, w, 2^70))
+		assert(not pcall(w.fill, w, 0/0))
+		w:scale(2^70)
+		assert(w[1] == 0)
+
+		assert(not pcall(DoubleBuffer, 2^61+1))
+		assert(not pcall(FloatBuffer, 2^62))
+		assert(not pcall(ByteBuffer, -1))
+	)*****";
+	DO(init);
+
+	InterLua::Span<double> d = InterLua::Buffer<double>::Push(L, 3);
+	STF_ASSERT(d.len == 3 && d[0] == 0);
+	STF_ASSERT((uintptr_t)d.ptr % InterLua::buffer_alignment == 0);
+	d[2] = 7;
+	lua_setglobal(L, "d");
+	DO("assert(d[3] == 7)");
+	STF_ASSERT(lua_gettop(L) == 0);
 	END();
 }
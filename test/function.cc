@@ -218,3 +218,195 @@ STF_TEST("class") {
 	STF_ASSERT(lua_gettop(L) == 0);
 	END();
 }
+
+STF_TEST("compile-time bound functions") {
+	LUA();
+	InterLua::GlobalNamespace(L).
+		Function<INTERLUA_FP(func_noargs_noreturn)>("test1").
+		Function<INTERLUA_FP(&func_int_noreturn)>("test2").
+		Function<INTERLUA_FP(func_noargs_int)>("test3").
+		Class<Foo>("Foo").
+			StaticFunction<INTERLUA_FP(Foo::set_foo)>("set_foo").
+			StaticFunction<INTERLUA_FP(&Foo::get_foo)>("get_foo").
+		End().
+	End();
+	DO("test1()");
+	STF_ASSERT(tester == 1);
+	DO("test2(test3()+1)");
+	STF_ASSERT(tester == 2);
+	DO("Foo.set_foo(Foo.get_foo() + 3)");
+	STF_ASSERT(tester == 5);
+	STF_ASSERT(lua_gettop(L) == 0);
+	END();
+}
+
+static const char *describe_none() { return "none"; }
+static const char *describe_number(double) { return "number"; }
+static const char *describe_string(const char*) { return "string"; }
+static const char *describe_two(int, bool) { return "two"; }
+static const char *describe_foo(const Foo&) { return "foo"; }
+
+STF_TEST("overload sets") {
+	LUA();
+	InterLua::GlobalNamespace(L).
+		Function("describe", describe_none, describe_number,
+			describe_string, describe_two).
+		Class<Foo>("Foo").
+			Constructor().
+			StaticFunction("describe", describe_foo, describe_number).
+		End().
+	End();
+	const char *code = R"*****(
+		assert(describe() == "none")
+		assert(describe(1.5) == "number")
+		assert(describe("x") == "string")
+		assert(describe(1, false) == "two")
+		assert(Foo.describe(Foo()) == "foo")
+		assert(Foo.describe(3) == "number")
+	)*****";
+	DO(code);
+	const char *errors[] = {
+		"describe({})",
+		"describe(1, 2, 3)",
+		"Foo.describe('x')",
+	};
+	for (auto e : errors) {
+		int fail = luaL_dostring(L, e);
+		if (!fail) {
+			STF_ERRORF("'%s' should report an error", e);
+		} else {
+			lua_pop(L, 1);
+		}
+	}
+	STF_ASSERT(lua_gettop(L) == 0);
+	END();
+}
+
+struct Tracker {
+	int *destroyed;
+	Tracker(int *destroyed): destroyed(destroyed) {}
+	Tracker(const Tracker &r): destroyed(r.destroyed) {}
+	~Tracker() { if (destroyed) (*destroyed)++; }
+};
+
+STF_TEST("lambdas and functors") {
+	int destroyed = 0;
+	int calls = 0;
+	{
+		LUA();
+		{
+			Tracker t(&destroyed);
+			InterLua::GlobalNamespace(L).
+				Function("add", [](int a, int b) { return a + b; }).
+				Function("count", [&calls]() { calls++; }).
+				Function("next", [calls]() mutable { return ++calls; }).
+				Function("tracked", [t](int x) { return x * 2; }).
+				Class<Foo>("Foo").
+					Constructor().
+					StaticFunction("twice", [&calls](int x) { calls += x; return x * 2; }).
+					Function("self", [](const Foo*) { return true; }).
+				End().
+			End();
+		}
+		// only the copy stored in lua is alive now
+		destroyed = 0;
+		const char *code = R"*****(
+			assert(add(1, 2) == 3)
+			count()
+			count()
+			assert(next() == 1 and next() == 2)
+			assert(tracked(21) == 42)
+			assert(Foo.twice(3) == 6)
+			assert(Foo():self())
+		)*****";
+		DO(code);
+		STF_ASSERT(calls == 5);
+		STF_ASSERT(destroyed == 0);
+		STF_ASSERT(lua_gettop(L) == 0);
+		END();
+	}
+	STF_ASSERT(destroyed == 1);
+}
+
+static size_t view_size(InterLua::StringView s) {
+	return s.len;
+}
+
+static InterLua::StringView view_tail(InterLua::StringView s) {
+	return {s.ptr + 1, s.len - 1};
+}
+
+static size_t view_ref_size(const InterLua::StringView &s) {
+	return s.len;
+}
+
+static const char *describe_view(InterLua::StringView&&) { return "string"; }
+
+STF_TEST("string views") {
+	LUA();
+	InterLua::GlobalNamespace(L).
+		Function("size", view_size).
+		Function<INTERLUA_FP(view_tail)>("tail").
+		Function("ref_size", view_ref_size).
+		Function("describe", describe_view, describe_number).
+	End();
+	const char *code = R"*****(
+		assert(size("a\0b\0c") == 5 and size("") == 0)
+		assert(tail("a\0b") == "\0b")
+		assert(not pcall(size, {}))
+		assert(ref_size("a\0b") == 3 and not pcall(ref_size, {}))
+		assert(describe("1") == "string" and describe(1) == "number")
+	)*****";
+	DO(code);
+	STF_ASSERT(InterLua::StringView("foo") == InterLua::StringView("foo\0", 3));
+	STF_ASSERT(InterLua::StringView("foo") != InterLua::StringView("fo"));
+	STF_ASSERT(lua_gettop(L) == 0);
+	END();
+}
+
+static const char *describe_ref(InterLua::Ref) { return "ref"; }
+
+STF_TEST("overload sets with Ref") {
+	LUA();
+	InterLua::GlobalNamespace(L).
+		Function("describe", describe_number, describe_ref).
+	End();
+	DO("assert(describe(1) == 'number' and describe({}) == 'ref')");
+	STF_ASSERT(lua_gettop(L) == 0);
+	END();
+}
+
+static unsigned int id_uint(unsigned int v) { return v; }
+static long long id_llong(long long v) { return v; }
+static unsigned long long id_ullong(unsigned long long v) { return v; }
+static const char *describe_int(int) { return "int"; }
+static int int_and_ref(int v, InterLua::Ref) { return v; }
+
+STF_TEST("wide integers") {
+	LUA();
+	InterLua::GlobalNamespace(L).
+		Function("uint", id_uint).
+		Function("llong", id_llong).
+		Function("ullong", id_ullong).
+		Function("describe", describe_int, describe_number).
+		Function("int_and_ref", int_and_ref).
+	End();
+	const char *code = R"*****(
+		assert(uint(4294967295) == 4294967295)
+		assert(llong(-9007199254740992) == -9007199254740992)
+		assert(ullong(9007199254740992) == 9007199254740992)
+		assert(describe(1) == "int")
+	)*****";
+	DO(code);
+#if LUA_VERSION_NUM >= 503
+	DO(R"(assert(describe(1.5) == "number"))");
+	DO(R"(assert(math.type(llong(1)) == "integer"))");
+	DO(R"(
+		local ok, err = pcall(int_and_ref, 3.5, {})
+		assert(not ok and err:find("number has no integer representation"))
+		assert(select(2, pcall(int_and_ref, "x", {})):find("number expected"))
+	)");
+#endif
+	STF_ASSERT(lua_gettop(L) == 0);
+	END();
+}
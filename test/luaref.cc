@@ -1,6 +1,8 @@
 #include "stf.hh"
 #include "helpers.hh"
 #include "interlua.hh"
+#include <vector>
+#include <unordered_set>
 
 STF_SUITE_NAME("luaref")
 
@@ -105,3 +107,276 @@ STF_TEST("Ref::operator[]") {
 	}
 	END();
 }
+
+STF_TEST("PinnedString") {
+	LUA();
+	{
+		std::vector<InterLua::PinnedString> queue;
+		std::unordered_set<InterLua::PinnedString> keys;
+		auto push = [&](InterLua::PinnedString s) {
+			queue.push_back(s);
+			keys.insert(std::move(s));
+		};
+		InterLua::GlobalNamespace(L).
+			Function("push", push).
+		End();
+		DO(R"(
+			push("hello")
+			push("wor\0ld")
+			push("hello")
+			collectgarbage()
+		)");
+		STF_ASSERT(lua_gettop(L) == 0);
+		STF_ASSERT(queue.size() == 3);
+		STF_ASSERT(keys.size() == 2);
+		STF_ASSERT(queue[0] == queue[2]);
+		STF_ASSERT(queue[0].Data() == queue[2].Data());
+		STF_ASSERT(queue[1].Length() == 6);
+		STF_ASSERT(memcmp(queue[1].Data(), "wor\0ld", 6) == 0);
+		STF_ASSERT(queue[0] == InterLua::StringView("hello"));
+		STF_ASSERT(queue[0] < queue[1]);
+		STF_ASSERT(keys.count(queue[1]) == 1);
+
+		InterLua::PinnedString copy;
+		copy = queue[1];
+		queue.clear();
+		keys.clear();
+		DO("collectgarbage()");
+		STF_ASSERT(copy.View() == InterLua::StringView("wor\0ld", 6));
+		copy.Push(L);
+		STF_ASSERT(lua_type(L, -1) == LUA_TSTRING);
+		STF_ASSERT(lua_tostring(L, -1) == copy.Data());
+		lua_pop(L, 1);
+
+		// pinned from a coroutine, which is collected before the release
+		DO(R"(
+			coroutine.resume(coroutine.create(function()
+				push("from coroutine")
+			end))
+			collectgarbage()
+			collectgarbage()
+		)");
+		STF_ASSERT(queue.size() == 1);
+		STF_ASSERT(queue[0] == InterLua::StringView("from coroutine"));
+		STF_ASSERT(queue[0].AsRef().State() == InterLua::main_thread(L));
+		queue.clear();
+		keys.clear();
+		STF_ASSERT(lua_gettop(L) == 0);
+	}
+	END();
+}
+
+static int stackref_len(InterLua::StackRef t) {
+	return t.Length();
+}
+
+// every level keeps a StackRef alive, far more than LUA_MINSTACK slots
+static int stackref_nest(lua_State *L, int n) {
+	auto v = InterLua::StackRef::New(L, n);
+	return n == 0 ? lua_gettop(L) : stackref_nest(L, n - 1);
+}
+
+static int stackref_depth(lua_State *L) {
+	return stackref_nest(L, 500);
+}
+
+STF_TEST("StackRef") {
+	LUA();
+	const char init[] = R"*****(
+		config = {
+			resolution = "1440x900",
+			sensitivity = 0.5,
+			player = {
+				name = "nsf",
+			},
+		}
+		function add(a, b)
+			return a + b
+		end
+		function bad()
+			error("oops")
+		end
+	)*****";
+	DO(init);
+	InterLua::GlobalNamespace(L).
+		Function("len", stackref_len).
+		Function("depth", stackref_depth).
+	End();
+	DO("assert(depth() > 500)");
+	{
+		auto config = InterLua::StackRef::Global(L, "config");
+		STF_ASSERT(config.IsTable());
+		STF_ASSERT(lua_gettop(L) == 1);
+		{
+			const char *res = config["resolution"];
+			STF_ASSERT(strcmp(res, "1440x900") == 0);
+			STF_ASSERT(lua_gettop(L) == 1);
+
+			auto name = config["player"]["name"];
+			STF_ASSERT(name == "nsf");
+			STF_ASSERT(strcmp(name.As<const char*>(), "nsf") == 0);
+			STF_ASSERT(lua_gettop(L) == 2);
+
+			config.Set("sensitivity", 0.7);
+			STF_ASSERT(config["sensitivity"] > 0.6);
+
+			auto add = InterLua::StackRef::Global(L, "add");
+			STF_ASSERT((int)add(5, 10) == 15);
+
+			InterLua::Error err;
+			auto bad = InterLua::StackRef::Global(L, "bad");
+			STF_ASSERT(bad(&err).IsNil());
+			STF_ASSERT(err);
+
+			auto t = InterLua::StackRef::NewTable(L);
+			t.Append(1);
+			t.Append(2);
+			STF_ASSERT(t.Length() == 2);
+			auto len = InterLua::StackRef::Global(L, "len");
+			STF_ASSERT(len(t) == 2);
+
+			auto ref = t.ToRef();
+			STF_ASSERT(ref.Length() == 2);
+		}
+		STF_ASSERT(lua_gettop(L) == 1);
+	}
+	STF_ASSERT(lua_gettop(L) == 0);
+	END();
+}
+
+STF_TEST("Ref::Get() and Path") {
+	LUA();
+	const char init[] = R"*****(
+		config = {
+			server = {
+				pool = { size = 8 },
+				hosts = { "a", "b" },
+			},
+		}
+	)*****";
+	DO(init);
+	{
+		auto config = InterLua::Global(L, "config");
+		STF_ASSERT(config.Get("server", "pool", "size") == 8);
+		STF_ASSERT(config.Get("server", "hosts", 2) == "b");
+		STF_ASSERT(config.Get("server", "missing", "size").IsNil());
+		STF_ASSERT(config.Get().IsTable());
+
+		InterLua::Path size(L, "server.pool.size");
+		InterLua::Path host(L, "server.hosts.1");
+		InterLua::Path pool(L, "server.pool");
+		InterLua::Path missing(L, "server.size.pool");
+		STF_ASSERT(size.Length() == 3);
+		STF_ASSERT(config.Get(size).As<int>() == 8);
+		STF_ASSERT(config.Get(host) == "a");
+		STF_ASSERT(config.Get(pool, "size") == 8);
+		STF_ASSERT(config.Get(missing).IsNil());
+		STF_ASSERT(lua_gettop(L) == 0);
+
+		auto sconfig = InterLua::StackRef::Global(L, "config");
+		STF_ASSERT(sconfig.Get(size) == 8);
+		auto hosts = sconfig.Get("server", "hosts");
+		STF_ASSERT(hosts.Length() == 2);
+		STF_ASSERT(lua_gettop(L) == 2);
+	}
+	STF_ASSERT(lua_gettop(L) == 0);
+	END();
+}
+
+static InterLua::LuaFunction<int (int)> stored;
+
+static void store(InterLua::LuaFunction<int (int)> f) {
+	stored = std::move(f);
+}
+
+static void store_ref(InterLua::Ref f) {
+	stored = std::move(f);
+}
+
+// calls 'f' on the thread which called the binding
+static bool call_here(InterLua::LuaFunction<bool ()> f, lua_State *L) {
+	return f.Call(L, &InterLua::DefaultError);
+}
+
+STF_TEST("LuaFunction") {
+	LUA();
+	const char init[] = R"*****(
+		calls = 0
+		function add(a, b) return a + b end
+		function greet(name) return name == "lua" end
+		function count() calls = calls + 1 return 1, 2, 3 end
+		function bad() error("oops") end
+		function str() return "x" end
+	)*****";
+	DO(init);
+	InterLua::GlobalNamespace(L).
+		Function("store", store).
+		Function("store_ref", store_ref).
+		Function("call_here", call_here).
+	End();
+	{
+		InterLua::LuaFunction<int (int, int)> add(L, "add");
+		STF_ASSERT(add.IsFunction());
+		STF_ASSERT(add(5, 10) == 15);
+
+		InterLua::LuaFunction<bool (const char*)> greet(L, "greet");
+		STF_ASSERT(greet("lua") && !greet("c++"));
+
+		InterLua::LuaFunction<void ()> count(L, "count");
+		count();
+		count();
+		STF_ASSERT(InterLua::Global(L, "calls") == 2);
+		STF_ASSERT(lua_gettop(L) == 0);
+
+		InterLua::Error err(InterLua::Quiet);
+		InterLua::LuaFunction<void ()> bad(L, "bad");
+		bad.Call(&err);
+		STF_ASSERT(err);
+		err.Reset();
+
+		InterLua::LuaFunction<int ()> str(L, "str");
+		STF_ASSERT(str.Call(&err) == 0);
+		STF_ASSERT(err);
+		STF_ASSERT(lua_gettop(L) == 0);
+
+		DO("store(function(x) return x * 2 end)");
+		STF_ASSERT(stored(21) == 42);
+
+		// stored from a coroutine, which is collected before the call
+		DO(R"(
+			coroutine.resume(coroutine.create(function()
+				store(function(x) return x * 3 end)
+			end))
+			collectgarbage()
+			collectgarbage()
+		)");
+		STF_ASSERT(stored(21) == 63);
+		STF_ASSERT(stored.AsRef().State() == InterLua::main_thread(L));
+
+		// the same, but the handle is made from a Ref
+		DO(R"(
+			coroutine.resume(coroutine.create(function()
+				store_ref(function(x) return x * 4 end)
+			end))
+			collectgarbage()
+			collectgarbage()
+		)");
+		STF_ASSERT(stored(21) == 84);
+		STF_ASSERT(stored.AsRef().State() == InterLua::main_thread(L));
+		stored = {};
+
+		// called from a coroutine, the function runs inside of it
+		DO(R"(
+			local co
+			co = coroutine.create(function()
+				return call_here(function()
+					return coroutine.running() == co
+				end)
+			end)
+			local ok, inside = coroutine.resume(co)
+			assert(ok and inside)
+		)");
+		STF_ASSERT(lua_gettop(L) == 0);
+	}
+	END();
+}
@@ -169,3 +169,74 @@ STF_TEST("class") {
 	STF_ASSERT(lua_gettop(L) == 0);
 	END();
 }
+
+class Point {
+	int y = 0;
+
+public:
+	int x = 0;
+	int id = 7;
+
+	Point() {}
+	int get_y() const { return y; }
+	void set_y(int v) { y = v; }
+	int sum() const { return x + y; }
+	const Point *as_const() const { return this; }
+};
+
+class Point3 : public Point {
+public:
+	int z = 0;
+	Point3() {}
+};
+
+STF_TEST("fields") {
+	LUA();
+	InterLua::GlobalNamespace(L).
+		Class<Point>("Point").
+			Fields().
+			Constructor().
+			Variable("x", &Point::x).
+			Variable("id", &Point::id, InterLua::ReadOnly).
+			Property("y", &Point::get_y, &Point::set_y).
+			Function("sum", &Point::sum).
+			Function("as_const", &Point::as_const).
+		End().
+		DerivedClass<Point3, Point>("Point3").
+			Constructor().
+			Variable("z", &Point3::z).
+		End().
+	End();
+	const char *code = R"*****(
+		local p = Point()
+		p.x = 3
+		p.y = p.x + 1
+		assert(p.x == 3 and p.y == 4 and p.id == 7)
+		assert(p:sum() == 7)
+		local c = p:as_const()
+		assert(c.x == 3 and c.y == 4 and c:sum() == 7)
+
+		local p3 = Point3()
+		p3.x, p3.y, p3.z = 1, 2, 3
+		assert(p3.x + p3.y + p3.z == 6 and p3:sum() == 3)
+		assert(p3.nonexistent == nil)
+	)*****";
+	DO(code);
+
+	const char *errors[] = {
+		"Point().id = 5",
+		"Point():as_const().x = 5",
+		"Point().nonexistent = 5",
+		"Point3().sum = 5",
+	};
+	for (auto e : errors) {
+		int fail = luaL_dostring(L, e);
+		if (!fail) {
+			STF_ERRORF("'%s' should report an error", e);
+		} else {
+			lua_pop(L, 1);
+		}
+	}
+	STF_ASSERT(lua_gettop(L) == 0);
+	END();
+}